@@ -0,0 +1,128 @@
+#include "mcp3008_linesensor.h"
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <xtensa/hal.h>
+
+using namespace mcp3008;
+
+// Each result is printed on one line, in this format:
+//   BENCH,<operation>,<mode>,<freq_hz>,<mask>,<iterations>,<us_per_call>,<calls_per_sec>
+//   STATS,<stage>,<mode>,<freq_hz>,<mask>,<count>,<min>,<max>,<mean>,<p99>
+//   CYCLES,<operation>,<mode>,<freq_hz>,<mask>,<iterations>,<cycles_per_frame>
+// STATS lines are in CPU cycles and printed only when built with MCP3008_STATS.
+// CYCLES,readPrepared reuses the prepared transaction descriptors on every frame,
+// CYCLES,readRebuilt switches the differential flag each frame, so every read rebuilds them first.
+// The difference between the two is the per-frame cost the prepared descriptors save.
+
+static constexpr int ITERATIONS = 2000;
+static constexpr int BURST_FRAMES = 256;
+
+static const int FREQUENCIES[] = { 1350000, 2000000, 3600000 };
+static const uint8_t MASKS[] = { 0xFF, 0x3C, 0x01 };
+
+static volatile int32_t sink;
+
+static const char* modeName(const Driver::Config& cfg) {
+    return cfg.polling ? "polling" : "queued";
+}
+
+template <typename Fn>
+static void measure(const char* operation, const Driver::Config& cfg, Fn fn) {
+    fn(); // warm-up
+
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        fn();
+    }
+    const int64_t elapsed = esp_timer_get_time() - start;
+
+    printf("BENCH,%s,%s,%d,0x%02x,%d,%.2f,%.0f\n", operation, modeName(cfg), cfg.freq, cfg.channels_mask,
+        ITERATIONS, double(elapsed) / ITERATIONS, ITERATIONS * 1e6 / elapsed);
+}
+
+template <typename Fn>
+static void measureCycles(const char* operation, const Driver::Config& cfg, Fn fn) {
+    fn(0); // warm-up
+
+    // Summed per frame, the cycle counter wraps in seconds
+    uint64_t elapsed = 0;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        const uint32_t start = xthal_get_ccount();
+        fn(i);
+        elapsed += xthal_get_ccount() - start;
+    }
+
+    printf("CYCLES,%s,%s,%d,0x%02x,%d,%u\n", operation, modeName(cfg), cfg.freq, cfg.channels_mask,
+        ITERATIONS, unsigned(elapsed / ITERATIONS));
+}
+
+static void printStats(const char* stage, const Driver::Config& cfg, const TimingStats& s) {
+#ifdef MCP3008_STATS
+    printf("STATS,%s,%s,%d,0x%02x,%u,%u,%u,%u,%u\n", stage, modeName(cfg), cfg.freq, cfg.channels_mask,
+        unsigned(s.count), unsigned(s.min), unsigned(s.max), unsigned(s.mean), unsigned(s.p99));
+#endif
+}
+
+static void benchConfig(const Driver::Config& cfg) {
+    LineSensor ls;
+    esp_err_t res = ls.install(cfg);
+    if (res != ESP_OK) {
+        printf("ERROR,install,%s,%d,0x%02x,%d\n", modeName(cfg), cfg.freq, cfg.channels_mask, res);
+        return;
+    }
+
+    uint16_t vals[Driver::CHANNELS];
+    const int first_channel = __builtin_ctz(cfg.channels_mask);
+
+    measure("read", cfg, [&]() { ls.read(vals); });
+    measure("readChannel", cfg, [&]() { sink = ls.readChannel(first_channel); });
+    measure("calibratedRead", cfg, [&]() { ls.calibratedRead(vals); });
+
+    measureCycles("readPrepared", cfg, [&](int) { ls.read(vals); });
+    measureCycles("readRebuilt", cfg, [&](int i) { ls.read(vals, (i & 1) != 0); });
+
+    ls.resetStats();
+    measure("readLine", cfg, [&]() { sink = ls.readLineFixed(); });
+
+    const auto stats = ls.getStats();
+    printStats("queue", cfg, stats.queue);
+    printStats("wait", cfg, stats.wait);
+    printStats("calibration", cfg, stats.calibration);
+    printStats("line", cfg, stats.line);
+
+    std::vector<uint16_t> burst(BURST_FRAMES * ls.getChannelsCount());
+    uint32_t samples_per_sec = 0;
+    const int64_t start = esp_timer_get_time();
+    res = ls.readFrames(burst.data(), BURST_FRAMES, false, &samples_per_sec);
+    const int64_t elapsed = esp_timer_get_time() - start;
+    if (res == ESP_OK && samples_per_sec != 0) {
+        printf("BENCH,readFrames,%s,%d,0x%02x,%d,%.2f,%.0f\n", modeName(cfg), cfg.freq, cfg.channels_mask,
+            BURST_FRAMES, double(elapsed) / BURST_FRAMES, BURST_FRAMES * 1e6 / elapsed);
+        printf("BENCH,readFramesSamples,%s,%d,0x%02x,%d,%.2f,%u\n", modeName(cfg), cfg.freq, cfg.channels_mask,
+            BURST_FRAMES * ls.getChannelsCount(), 1e6 / samples_per_sec, unsigned(samples_per_sec));
+    }
+
+    ls.uninstall();
+}
+
+void setup() {
+    delay(1000);
+    printf("BEGIN\n");
+
+    for (bool polling : { false, true }) {
+        for (int freq : FREQUENCIES) {
+            for (uint8_t mask : MASKS) {
+                Driver::Config cfg;
+                cfg.freq = freq;
+                cfg.channels_mask = mask;
+                cfg.polling = polling;
+                benchConfig(cfg);
+            }
+        }
+    }
+
+    printf("END\n");
+}
+
+void loop() {
+}
@@ -0,0 +1,125 @@
+#include <esp32/rom/crc.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mcp3008_linesensor.h"
+
+#define TAG "Mcp3008Calibration"
+
+namespace mcp3008 {
+
+static constexpr uint16_t STORED_MAGIC = 0x3008;
+static constexpr uint8_t STORED_VERSION = 1;
+
+// The NVS blob, bump STORED_VERSION whenever this changes.
+struct StoredCalibration {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels_mask; //!< Config::channels_mask of the sensor which saved it, informative only
+    LineSensor::CalibrationData data;
+    uint32_t crc; //!< crc32_le of everything above
+} __attribute__((packed));
+
+struct SaveJob {
+    LineSensor* sensor;
+    char key[16];
+    char nvs_namespace[16];
+    StoredCalibration blob;
+};
+
+static uint32_t storedCrc(const StoredCalibration& blob) {
+    return crc32_le(0, (const uint8_t*)&blob, offsetof(StoredCalibration, crc));
+}
+
+static StoredCalibration makeStored(const LineSensor& sensor) {
+    StoredCalibration blob;
+    blob.magic = STORED_MAGIC;
+    blob.version = STORED_VERSION;
+    blob.channels_mask = sensor.getChannelsMask();
+    blob.data = sensor.getCalibration();
+    blob.crc = storedCrc(blob);
+    return blob;
+}
+
+static esp_err_t writeStored(const char* key, const char* nvs_namespace, const StoredCalibration& blob) {
+    nvs_handle handle;
+    esp_err_t res = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if (res != ESP_OK)
+        return res;
+
+    res = nvs_set_blob(handle, key, &blob, sizeof(blob));
+    if (res == ESP_OK)
+        res = nvs_commit(handle);
+    nvs_close(handle);
+    return res;
+}
+
+esp_err_t LineSensor::loadCalibration(const char* key, const char* nvs_namespace) {
+    nvs_handle handle;
+    esp_err_t res = nvs_open(nvs_namespace, NVS_READONLY, &handle);
+    if (res != ESP_OK)
+        return res;
+
+    StoredCalibration blob;
+    size_t size = sizeof(blob);
+    res = nvs_get_blob(handle, key, &blob, &size);
+    nvs_close(handle);
+    if (res != ESP_OK)
+        return res;
+
+    if (size != sizeof(blob) || blob.magic != STORED_MAGIC || blob.version != STORED_VERSION) {
+        ESP_LOGE(TAG, "calibration %s/%s has an unknown format", nvs_namespace, key);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    if (blob.crc != storedCrc(blob)) {
+        ESP_LOGE(TAG, "calibration %s/%s is damaged", nvs_namespace, key);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return setCalibration(blob.data) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t LineSensor::saveCalibration(const char* key, const char* nvs_namespace) const {
+    return writeStored(key, nvs_namespace, makeStored(*this));
+}
+
+esp_err_t LineSensor::saveCalibrationAsync(const char* key, const char* nvs_namespace, UBaseType_t priority, BaseType_t core) {
+    if (strlen(key) >= sizeof(SaveJob::key) || strlen(nvs_namespace) >= sizeof(SaveJob::nvs_namespace))
+        return ESP_ERR_INVALID_ARG;
+
+    if (m_saving_calibration.exchange(true))
+        return ESP_ERR_INVALID_STATE;
+
+    auto* job = new SaveJob();
+    job->sensor = this;
+    strcpy(job->key, key);
+    strcpy(job->nvs_namespace, nvs_namespace);
+    job->blob = makeStored(*this);
+
+    if (xTaskCreatePinnedToCore(saveCalibrationTask, "mcp3008_save", 3072, job, priority, nullptr, core) != pdPASS) {
+        ESP_LOGE(TAG, "failed to create the calibration saving task");
+        delete job;
+        m_saving_calibration.store(false);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void LineSensor::saveCalibrationTask(void* job_ptr) {
+    auto* job = (SaveJob*)job_ptr;
+    LineSensor* sensor = job->sensor;
+
+    const esp_err_t res = writeStored(job->key, job->nvs_namespace, job->blob);
+    if (res != ESP_OK)
+        ESP_LOGE(TAG, "failed to save the calibration: %d", res);
+    delete job;
+
+    sensor->m_save_result.store(res);
+    sensor->m_saving_calibration.store(false);
+    vTaskDelete(nullptr);
+}
+
+}; // namespace mcp3008
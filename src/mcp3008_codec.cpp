@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "mcp3008_codec.h"
+
+namespace mcp3008 {
+namespace codec {
+
+void pack10(const uint16_t* values, size_t count, uint8_t* out) {
+    memset(out, 0, packedSize(count));
+    for (size_t i = 0; i < count; ++i) {
+        // Values start at an even bit, so the shift is at most 6 and they always fit two bytes
+        const size_t bit = i * 10;
+        const uint32_t val = uint32_t(values[i] & MAX_VAL) << (bit % 8);
+        out[bit / 8] |= val;
+        out[bit / 8 + 1] |= val >> 8;
+    }
+}
+
+void unpack10(const uint8_t* in, size_t count, uint16_t* values) {
+    for (size_t i = 0; i < count; ++i) {
+        const size_t bit = i * 10;
+        const size_t byte = bit / 8;
+        const uint32_t word = in[byte] | (uint32_t(in[byte + 1]) << 8);
+        values[i] = (word >> (bit % 8)) & MAX_VAL;
+    }
+}
+
+DeltaEncoder::DeltaEncoder(size_t channels)
+    : m_channels(channels < MAX_CHANNELS ? channels : MAX_CHANNELS) {
+    reset();
+}
+
+void DeltaEncoder::reset() {
+    memset(m_prev, 0, sizeof(m_prev));
+}
+
+size_t DeltaEncoder::encode(const uint16_t* values, uint8_t* out) {
+    uint8_t* pos = out;
+    for (size_t i = 0; i < m_channels; ++i) {
+        const int32_t delta = int32_t(values[i] & MAX_VAL) - m_prev[i];
+        const uint32_t zigzag = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31);
+        if (zigzag < 0x80) {
+            *pos++ = zigzag;
+        } else {
+            *pos++ = 0x80 | (zigzag & 0x7F);
+            *pos++ = zigzag >> 7;
+        }
+        m_prev[i] = values[i] & MAX_VAL;
+    }
+    return pos - out;
+}
+
+DeltaDecoder::DeltaDecoder(size_t channels)
+    : m_channels(channels < MAX_CHANNELS ? channels : MAX_CHANNELS) {
+    reset();
+}
+
+void DeltaDecoder::reset() {
+    memset(m_prev, 0, sizeof(m_prev));
+}
+
+size_t DeltaDecoder::decode(const uint8_t* in, size_t size, uint16_t* values) {
+    uint16_t decoded[MAX_CHANNELS];
+    size_t pos = 0;
+    for (size_t i = 0; i < m_channels; ++i) {
+        if (pos >= size)
+            return 0;
+
+        uint32_t zigzag = in[pos++];
+        if (zigzag & 0x80) {
+            if (pos >= size || (in[pos] & 0x80) != 0)
+                return 0;
+            zigzag = (zigzag & 0x7F) | (uint32_t(in[pos++]) << 7);
+        }
+
+        const int32_t delta = int32_t(zigzag >> 1) ^ -int32_t(zigzag & 1);
+        const int32_t val = m_prev[i] + delta;
+        if (val < 0 || val > MAX_VAL)
+            return 0;
+        decoded[i] = val;
+    }
+
+    memcpy(m_prev, decoded, m_channels * sizeof(uint16_t));
+    memcpy(values, decoded, m_channels * sizeof(uint16_t));
+    return pos;
+}
+
+}; // namespace codec
+}; // namespace mcp3008
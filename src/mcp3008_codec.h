@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mcp3008 {
+
+/**
+ * \brief Compact binary encodings of frames, for recording and streaming.
+ *
+ * This header and mcp3008_codec.cpp do not depend on ESP-IDF, so they can be
+ * compiled into host tools which decode the recordings.
+ */
+namespace codec {
+
+static constexpr size_t MAX_CHANNELS = 8; //!< Same as Driver::CHANNELS.
+static constexpr uint16_t MAX_VAL = 1023; //!< Same as Driver::MAX_VAL, the values must not exceed it.
+
+/**
+ * \brief Size of \p count values packed by pack10(), 10 bytes for a full frame.
+ */
+constexpr size_t packedSize(size_t count) { return (count * 10 + 7) / 8; }
+
+/**
+ * \brief Pack 10-bit values, LSB first: value i occupies bits 10*i to 10*i + 9 of \p out.
+ *
+ * \param out buffer of at least packedSize(\p count) bytes. Unused bits of the last byte are zero.
+ */
+void pack10(const uint16_t* values, size_t count, uint8_t* out);
+
+void unpack10(const uint8_t* in, size_t count, uint16_t* values); //!< Inverse of pack10().
+
+/**
+ * \brief Encodes each frame as per-channel differences from the previous one.
+ *
+ * Each difference is zigzag-encoded into a varint of 1 byte (differences within <-64; 63>)
+ * or 2 bytes, so slowly changing channels cost 1 byte per frame. The first frame
+ * after reset() is encoded against zeros, so any frame can be made a key frame,
+ * from which the decoding can start, by resetting both the encoder and the DeltaDecoder.
+ */
+class DeltaEncoder {
+public:
+    static constexpr size_t MAX_FRAME_SIZE = 2 * MAX_CHANNELS; //!< Most bytes encode() writes.
+
+    /**
+     * \param channels amount of values in each frame, at most MAX_CHANNELS.
+     */
+    explicit DeltaEncoder(size_t channels);
+
+    void reset(); //!< The next frame is a key frame.
+
+    /**
+     * \brief Encode one frame of channels values.
+     *
+     * \param out buffer of at least MAX_FRAME_SIZE bytes.
+     * \return amount of bytes written to \p out.
+     */
+    size_t encode(const uint16_t* values, uint8_t* out);
+
+private:
+    size_t m_channels;
+    uint16_t m_prev[MAX_CHANNELS];
+};
+
+/**
+ * \brief Decodes frames encoded by DeltaEncoder.
+ */
+class DeltaDecoder {
+public:
+    explicit DeltaDecoder(size_t channels); //!< See DeltaEncoder::DeltaEncoder().
+
+    void reset(); //!< The next frame is a key frame, see DeltaEncoder::reset().
+
+    /**
+     * \brief Decode one frame.
+     *
+     * \param in encoded data, may contain more frames after this one.
+     * \param size amount of bytes available in \p in.
+     * \param values the decoded values are written here.
+     * \return amount of bytes consumed, 0 if the data is truncated or invalid,
+     *         \p values and the decoder state are unchanged in that case.
+     */
+    size_t decode(const uint8_t* in, size_t size, uint16_t* values);
+
+private:
+    size_t m_channels;
+    uint16_t m_prev[MAX_CHANNELS];
+};
+
+}; // namespace codec
+}; // namespace mcp3008
@@ -1,5 +1,11 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <driver/gpio.h>
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <soc/gpio_struct.h>
 
 #include "mcp3008_driver.h"
 
@@ -7,11 +13,49 @@
 
 namespace mcp3008 {
 
+// Amount of attached Drivers on each SPI host, the bus is initialized
+// by the first one and freed by the last one.
+static int s_bus_users[VSPI_HOST + 1] = { 0 };
+// Was the bus initialized by the first Driver, or by someone else before it?
+static bool s_bus_owned[VSPI_HOST + 1] = { false };
+
+// Layout of spi_transaction_t::user in readFrames() and readAmbientCompensated() bursts:
+// the index of the result, and optionally the emitter level to set before the conversion.
+static constexpr uint32_t BURST_SAMPLE_MASK = 0x00FFFFFF;
+static constexpr int EMITTER_PIN_SHIFT = 24; //!< 6 bits of the GPIO number
+static constexpr uint32_t EMITTER_LEVEL = 1u << 30;
+static constexpr uint32_t EMITTER_SET = 1u << 31;
+
 Driver::Driver()
     : m_spi(NULL)
+    , m_transport(&m_spi_transport)
     , m_spi_dev(HSPI_HOST)
     , m_installed(false)
-    , m_channels_mask(0xFF) {
+    , m_attached(false)
+    , m_channels_mask(0xFF)
+    , m_channels_count(CHANNELS)
+    , m_polling(false)
+    , m_freq(0)
+    , m_compact_framing(false)
+    , m_transactions_differential(false)
+    , m_queued(0)
+    , m_queued_mask(0)
+    , m_read_pending(false)
+    , m_pending_queued(false)
+    , m_pending_mask(0)
+    , m_pending_differential(false)
+    , m_pin_emitter(gpio_num_t(-1))
+    , m_emitter_on_level(1)
+    , m_emitter_settle(0)
+    , m_sampler_task(nullptr)
+    , m_sampler_done(nullptr)
+    , m_sampler_stop(false)
+    , m_sampler_reset_stats(false)
+    , m_sampler_timer(nullptr) {
+    for (int i = 0; i < CHANNELS; ++i) {
+        m_channel_index[i] = i;
+        m_channels[i] = i;
+    }
 }
 
 Driver::~Driver() {
@@ -22,6 +66,62 @@ esp_err_t Driver::install(const Driver::Config& cfg) {
     if (m_installed)
         return ESP_OK;
 
+    if (cfg.spi_dev < 0 || cfg.spi_dev > VSPI_HOST)
+        return ESP_ERR_INVALID_ARG;
+    // The ambient burst switches the emitters on its first conversion, it needs one
+    if (cfg.pin_emitter >= 0 && cfg.channels_mask == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    m_spi_dev = cfg.spi_dev;
+    m_channels_mask = cfg.channels_mask;
+    m_channels_count = __builtin_popcount(cfg.channels_mask);
+    m_polling = cfg.polling;
+    m_freq = cfg.freq;
+    m_compact_framing = cfg.compact_framing;
+    m_burst.resize(std::max(int(CHANNELS), int(cfg.queue_size)));
+    for (int i = 0, idx = 0; i < CHANNELS; ++i) {
+        m_channel_index[i] = idx;
+        if (((1 << i) & m_channels_mask) != 0)
+            m_channels[idx++] = i;
+    }
+    prepareTransactions(false);
+
+    m_pin_emitter = cfg.pin_emitter;
+    m_emitter_on_level = cfg.emitter_on_level ? 1 : 0;
+    m_emitter_settle = cfg.emitter_settle;
+    m_emitter_sequence.clear();
+    m_emitter_flags.clear();
+    if (m_pin_emitter >= 0) {
+        // Emitters off for the ambient frame, then on for the lit one,
+        // each preceded by the settling conversions of the first channel.
+        for (int lit = 0; lit < 2; ++lit) {
+            const uint32_t level = (lit ? m_emitter_on_level : !m_emitter_on_level) ? EMITTER_LEVEL : 0;
+            const size_t first = m_emitter_sequence.size();
+            for (int i = 0; i < m_emitter_settle; ++i)
+                m_emitter_sequence.push_back(m_channels[0]);
+            for (int i = 0; i < m_channels_count; ++i)
+                m_emitter_sequence.push_back(m_channels[i]);
+
+            m_emitter_flags.resize(m_emitter_sequence.size(), 0);
+            m_emitter_flags[first] = EMITTER_SET | level | (uint32_t(m_pin_emitter) << EMITTER_PIN_SHIFT);
+        }
+        m_emitter_samples.resize(m_emitter_sequence.size());
+    }
+
+    if (cfg.lazy_install) {
+        m_attach_cfg = cfg;
+        m_installed = true;
+        return ESP_OK;
+    }
+
+    const esp_err_t ret = attach(cfg);
+    if (ret != ESP_OK)
+        return ret;
+    m_installed = true;
+    return ESP_OK;
+}
+
+esp_err_t Driver::attach(const Config& cfg) {
     esp_err_t ret;
     spi_bus_config_t buscfg = { 0 };
     buscfg.miso_io_num = cfg.pin_miso;
@@ -34,66 +134,214 @@ esp_err_t Driver::install(const Driver::Config& cfg) {
     devcfg.clock_speed_hz = cfg.freq;
     devcfg.mode = 0;
     devcfg.spics_io_num = cfg.pin_cs;
-    devcfg.queue_size = CHANNELS;
+    devcfg.queue_size = m_burst.size();
+    if (cfg.pin_emitter >= 0)
+        devcfg.pre_cb = emitterPreCallback;
+
+    if (cfg.transport) {
+        m_transport = cfg.transport;
+    } else {
+        esp_err_t init_ret = ESP_OK;
+        if (s_bus_users[cfg.spi_dev] == 0) {
+            init_ret = spi_bus_initialize(cfg.spi_dev, &buscfg, cfg.getDmaChannel());
+            if (init_ret != ESP_OK && init_ret != ESP_ERR_INVALID_STATE)
+                return init_ret;
+            s_bus_owned[cfg.spi_dev] = init_ret == ESP_OK;
+        }
 
-    ret = spi_bus_initialize(cfg.spi_dev, &buscfg, 1);
-    if (ret != ESP_OK) {
-        return ret;
+        // ESP_ERR_INVALID_STATE from spi_bus_initialize() means either a master bus
+        // initialized by another driver, which accepts the device, or a conflict:
+        // the host claimed by e.g. the SPI slave driver, or the DMA channel in use,
+        // in which case the bus is not initialized and adding the device fails the same way.
+        ret = spi_bus_add_device(cfg.spi_dev, &devcfg, &m_spi);
+        if (ret != ESP_OK) {
+            if (s_bus_users[cfg.spi_dev] == 0 && s_bus_owned[cfg.spi_dev])
+                spi_bus_free(cfg.spi_dev);
+            if (init_ret == ESP_ERR_INVALID_STATE && ret == ESP_ERR_INVALID_STATE) {
+                ESP_LOGE(TAG, "SPI host %d or DMA channel %d is already in use", cfg.spi_dev, cfg.getDmaChannel());
+                return init_ret;
+            }
+            return ret;
+        }
+        if (init_ret == ESP_ERR_INVALID_STATE)
+            ESP_LOGD(TAG, "SPI host %d is already initialized, sharing it", cfg.spi_dev);
+        ++s_bus_users[cfg.spi_dev];
+
+        m_spi_transport.setDevice(m_spi);
+        m_transport = &m_spi_transport;
     }
 
-    ret = spi_bus_add_device(cfg.spi_dev, &devcfg, &m_spi);
-    if (ret != ESP_OK) {
-        spi_bus_free(cfg.spi_dev);
-        return ret;
+    if (m_pin_emitter >= 0) {
+        gpio_set_direction(m_pin_emitter, GPIO_MODE_OUTPUT);
+        gpio_set_level(m_pin_emitter, m_emitter_on_level);
     }
 
-    m_spi_dev = cfg.spi_dev;
-    m_channels_mask = cfg.channels_mask;
-    m_installed = true;
+    if (m_transport == &m_spi_transport && cfg.max_freq > cfg.freq) {
+        ret = tuneFrequency(cfg, devcfg);
+        if (ret != ESP_OK) {
+            // Unless setDeviceFrequency() removed the device and could not add it back
+            if (m_spi)
+                spi_bus_remove_device(m_spi);
+            m_spi = NULL;
+            m_spi_transport.setDevice(NULL);
+            if (--s_bus_users[cfg.spi_dev] == 0 && s_bus_owned[cfg.spi_dev])
+                spi_bus_free(cfg.spi_dev);
+            m_transport = &m_spi_transport;
+            return ret;
+        }
+    }
+
+    m_attached = true;
     return ESP_OK;
 }
 
-esp_err_t Driver::uninstall() {
+esp_err_t Driver::ensureAttached() const {
     if (!m_installed)
+        return ESP_FAIL;
+    if (m_attached)
+        return ESP_OK;
+    return const_cast<Driver*>(this)->attach(m_attach_cfg);
+}
+
+esp_err_t Driver::tuneFrequency(const Config& cfg, spi_device_interface_config_t& devcfg) {
+    const uint8_t mask = cfg.reference_channel >= 0 ? (1 << (cfg.reference_channel & 0x07)) : m_channels_mask;
+
+    uint16_t base[CHANNELS];
+    bool valid;
+    esp_err_t res = measureChannels(mask, base, valid);
+    if (res != ESP_OK)
+        return res;
+
+    uint16_t expected[CHANNELS];
+    std::copy(base, base + CHANNELS, expected);
+    if (cfg.reference_channel >= 0)
+        expected[cfg.reference_channel & 0x07] = cfg.reference_value;
+
+    auto passes = [&](const uint16_t* means) {
+        for (uint8_t m = mask; m != 0; m &= m - 1) {
+            const int chan = __builtin_ctz(m);
+            if (std::abs(int(means[chan]) - int(expected[chan])) > cfg.freq_tolerance)
+                return false;
+        }
+        return true;
+    };
+
+    if (!valid || !passes(base)) {
+        ESP_LOGW(TAG, "the conversions fail the check already at %d Hz, keeping it", cfg.freq);
         return ESP_OK;
+    }
+
+    int best = cfg.freq;
+    int freq = cfg.freq;
+    while (freq < cfg.max_freq) {
+        freq = std::min(cfg.max_freq, freq + freq / 4);
+        res = setDeviceFrequency(devcfg, freq);
+        if (res != ESP_OK)
+            return res;
+
+        uint16_t means[CHANNELS];
+        res = measureChannels(mask, means, valid);
+        if (res != ESP_OK)
+            return res;
+        if (!valid || !passes(means))
+            break;
+        best = freq;
+    }
+
+    if (m_freq != best) {
+        res = setDeviceFrequency(devcfg, best);
+        if (res != ESP_OK)
+            return res;
+    }
+    ESP_LOGI(TAG, "selected SPI frequency %d Hz", best);
+    return ESP_OK;
+}
 
+esp_err_t Driver::setDeviceFrequency(spi_device_interface_config_t& devcfg, int freq) {
     esp_err_t res = spi_bus_remove_device(m_spi);
     if (res != ESP_OK)
         return res;
+    m_spi = NULL;
 
-    res = spi_bus_free(m_spi_dev);
+    devcfg.clock_speed_hz = freq;
+    res = spi_bus_add_device(m_spi_dev, &devcfg, &m_spi);
     if (res != ESP_OK)
         return res;
 
-    m_installed = false;
+    m_spi_transport.setDevice(m_spi);
+    m_freq = freq;
     return ESP_OK;
 }
 
-int Driver::requestToChannel(int request) const {
-    if (m_channels_mask == 0xFF)
-        return request;
+esp_err_t Driver::measureChannels(uint8_t mask, uint16_t* means, bool& valid) const {
+    static constexpr int SAMPLES = 16;
+
+    valid = true;
+    spi_transaction_t t;
+    for (; mask != 0; mask &= mask - 1) {
+        const int chan = __builtin_ctz(mask);
+        uint32_t sum = 0;
+        for (int i = 0; i < SAMPLES; ++i) {
+            prepareTransaction(t, chan, false);
+            const esp_err_t res = m_transport->pollingTransmit(&t);
+            if (res != ESP_OK)
+                return res;
+            valid = valid && checkTransaction(t);
+            sum += decodeTransaction(t);
+        }
+        means[chan] = (sum + SAMPLES / 2) / SAMPLES;
+    }
+    return ESP_OK;
+}
 
-    int requested = 0;
-    for (int i = 0; i < CHANNELS; ++i) {
-        if (((1 << i) & m_channels_mask) != 0) {
-            if (requested++ == request)
-                return i;
+esp_err_t Driver::uninstall() {
+    if (!m_installed)
+        return ESP_OK;
+
+    if (!m_attached) {
+        m_installed = false;
+        return ESP_OK;
+    }
+
+    if (isSampling())
+        stopSampling();
+
+    spi_transaction_t* trans = NULL;
+    for (; m_queued > 0; --m_queued) {
+        m_transport->getTransResult(&trans, portMAX_DELAY);
+    }
+    m_read_pending = false;
+
+    if (m_transport == &m_spi_transport) {
+        esp_err_t res = spi_bus_remove_device(m_spi);
+        if (res != ESP_OK)
+            return res;
+        m_spi = NULL;
+
+        if (--s_bus_users[m_spi_dev] == 0 && s_bus_owned[m_spi_dev]) {
+            res = spi_bus_free(m_spi_dev);
+            if (res != ESP_OK)
+                return res;
         }
     }
 
+    m_transport = &m_spi_transport;
+    m_attached = false;
+    m_installed = false;
+    return ESP_OK;
+}
+
+int Driver::requestToChannel(int request) const {
+    if (request >= 0 && request < m_channels_count)
+        return m_channels[request];
+
     ESP_LOGE(TAG, "Invalid requestToChannel call %d", request);
     return 0;
 }
 
 esp_err_t Driver::read(std::vector<uint16_t>& results, bool differential) const {
-    int requested = 0;
-    for (int i = 0; i < CHANNELS; ++i) {
-        if (((1 << i) & m_channels_mask) != 0)
-            ++requested;
-    }
-
     const size_t orig_size = results.size();
-    results.resize(orig_size + requested);
+    results.resize(orig_size + m_channels_count);
 
     esp_err_t res = this->read(results.data() + orig_size, differential);
     if (res != ESP_OK) {
@@ -104,44 +352,408 @@ esp_err_t Driver::read(std::vector<uint16_t>& results, bool differential) const
 }
 
 esp_err_t Driver::read(uint16_t* dest, bool differential) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+    if (m_read_pending)
+        return ESP_ERR_INVALID_STATE;
+
+    if (isSampling()) {
+        if (differential != m_sampler_cfg.differential)
+            return ESP_ERR_INVALID_STATE;
+
+        Frame frame;
+        m_latest.read(frame);
+        std::copy(frame.values, frame.values + m_channels_count, dest);
+        return ESP_OK;
+    }
+
+    return readBus(dest, differential, m_channels_mask);
+}
+
+esp_err_t Driver::read(uint8_t mask, uint16_t* dest, bool differential) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+    if (m_read_pending)
+        return ESP_ERR_INVALID_STATE;
+
+    if (isSampling()) {
+        if (differential != m_sampler_cfg.differential || (mask & ~m_channels_mask) != 0)
+            return ESP_ERR_INVALID_STATE;
+
+        Frame frame;
+        m_latest.read(frame);
+        for (; mask != 0; mask &= mask - 1) {
+            *dest++ = frame.values[m_channel_index[__builtin_ctz(mask)]];
+        }
+        return ESP_OK;
+    }
+
+    return readBus(dest, differential, mask);
+}
+
+esp_err_t Driver::readDifferential(uint8_t pairs, uint16_t* dest) const {
+    uint16_t vals[CHANNELS];
+    const esp_err_t res = read(pairs, vals, true);
+    if (res != ESP_OK)
+        return res;
+
+    const uint16_t* val = vals;
+    for (; pairs != 0; pairs &= pairs - 1) {
+        dest[__builtin_ctz(pairs)] = *val++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Driver::readDifferentialSigned(uint8_t pairs, int16_t* dest) const {
+    uint8_t codes = 0;
+    for (int i = 0; i < CHANNELS / 2; ++i) {
+        if (pairs & (1 << i))
+            codes |= 0x03 << (2 * i);
+    }
+
+    uint16_t vals[CHANNELS];
+    const esp_err_t res = readDifferential(codes, vals);
+    if (res != ESP_OK)
+        return res;
+
+    for (int i = 0; i < CHANNELS / 2; ++i) {
+        if (pairs & (1 << i))
+            dest[i] = int16_t(vals[2 * i]) - int16_t(vals[2 * i + 1]);
+    }
+    return ESP_OK;
+}
+
+esp_err_t Driver::startReadMask(uint8_t mask, bool differential) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+    if (m_read_pending)
+        return ESP_ERR_INVALID_STATE;
+
+    // While sampling, the bus and the queue state belong to the sampling task,
+    // finishRead() then only copies the newest frame.
+    const bool queued = !isSampling();
+    if (queued) {
+        const esp_err_t res = queueFrame(differential, mask);
+        if (res != ESP_OK)
+            return res;
+    } else if (differential != m_sampler_cfg.differential || (mask & ~m_channels_mask) != 0) {
+        // Validated here, so that finishRead() fails only for the same reasons as read()
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    m_pending_queued = queued;
+    m_pending_mask = mask;
+    m_pending_differential = differential;
+    m_read_pending = true;
+    return ESP_OK;
+}
+
+esp_err_t Driver::finishRead(uint16_t* dest) const {
     if (!m_installed)
         return ESP_FAIL;
+    if (!m_read_pending)
+        return ESP_ERR_INVALID_STATE;
 
-    int requested = 0;
-    spi_transaction_t transactions[CHANNELS] = { 0 };
-    for (int i = 0; i < CHANNELS; ++i) {
-        if (((1 << i) & m_channels_mask) == 0)
-            continue;
+    m_read_pending = false;
 
-        auto& t = transactions[i];
-        t.user = (void*)requested;
-        t.flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA;
+    // startSampling() fails while a read is pending, so nobody else used the queue since.
+    if (m_pending_queued)
+        return collectFrame(dest);
+
+    // The sampling task may have been stopped since startRead(),
+    // then the frame is read from the chip by read().
+    return read(m_pending_mask, dest, m_pending_differential);
+}
+
+void Driver::prepareTransaction(spi_transaction_t& t, int channel, bool differential) const {
+    t = spi_transaction_t();
+    t.user = (void*)intptr_t(channel);
+    t.flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA;
+    if (m_compact_framing) {
+        // Start bit on the first clock: null bit at clock 7, B9..B0 at clocks 8 to 17
+        t.length = COMPACT_FRAME_BITS;
+        t.tx_data[0] = 0x80 | (!differential << 6) | ((channel & 0x07) << 3);
+    } else {
         t.length = 3 * 8;
         t.tx_data[0] = 1;
-        t.tx_data[1] = (!differential << 7) | ((i & 0x07) << 4);
+        t.tx_data[1] = (!differential << 7) | ((channel & 0x07) << 4);
+    }
+}
+
+uint16_t Driver::decodeTransaction(const spi_transaction_t& t) const {
+    if (m_compact_framing)
+        return ((t.rx_data[0] & 0x01) << 9) | (t.rx_data[1] << 1) | (t.rx_data[2] >> 7);
+    return ((t.rx_data[1] & 0x03) << 8) | t.rx_data[2];
+}
+
+bool Driver::checkTransaction(const spi_transaction_t& t) const {
+    if (m_compact_framing)
+        return (t.rx_data[0] & 0x02) == 0;
+    return (t.rx_data[1] & 0x04) == 0;
+}
+
+void Driver::prepareTransactions(bool differential) const {
+    for (int i = 0; i < CHANNELS; ++i) {
+        prepareTransaction(m_transactions[i], i, differential);
+    }
+    m_transactions_differential = differential;
+}
+
+esp_err_t Driver::readBus(uint16_t* dest, bool differential, uint8_t mask) const {
+    const esp_err_t res = queueFrame(differential, mask);
+    if (res != ESP_OK)
+        return res;
+    return collectFrame(dest);
+}
+
+esp_err_t Driver::queueFrame(bool differential, uint8_t mask) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+
+    if (differential != m_transactions_differential)
+        prepareTransactions(differential);
+
+    m_queued_mask = mask;
+
+    // The polling frame is read all at once in collectFrame()
+    if (m_polling)
+        return ESP_OK;
 
-        esp_err_t res = spi_device_queue_trans(m_spi, &transactions[i], 100);
+    MCP3008_STATS_START(queue_start);
+    esp_err_t res = ESP_OK;
+    int requested = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        res = m_transport->queueTrans(&m_transactions[__builtin_ctz(mask)], 100);
         if (res != ESP_OK)
-            return res;
+            break;
         ++requested;
     }
+    MCP3008_STATS_RECORD(m_stats.queue, queue_start);
 
-    if (requested == 0)
-        return ESP_OK;
+    if (res != ESP_OK) {
+        // Collect everything that was queued, so that the results
+        // do not get mixed into the next read.
+        spi_transaction_t* trans = NULL;
+        for (int i = 0; i < requested; ++i) {
+            m_transport->getTransResult(&trans, portMAX_DELAY);
+        }
+        requested = 0;
+    }
+    m_queued = requested;
+    return res;
+}
+
+esp_err_t Driver::collectFrame(uint16_t* dest) const {
+    if (!m_installed)
+        return ESP_FAIL;
 
+    if (m_polling)
+        return readBusPolling(dest, m_queued_mask);
+
+    const bool default_mask = m_queued_mask == m_channels_mask;
+
+    MCP3008_STATS_START(wait_start);
     spi_transaction_t* trans = NULL;
-    for (int i = 0; i < requested; ++i) {
-        esp_err_t res = spi_device_get_trans_result(m_spi, &trans, portMAX_DELAY);
-        if (res != ESP_OK) {
+    while (m_queued > 0) {
+        esp_err_t res = m_transport->getTransResult(&trans, portMAX_DELAY);
+        if (res != ESP_OK)
+            return res;
+        --m_queued;
+
+        const int chan = (intptr_t)trans->user;
+        const int idx = default_mask ? m_channel_index[chan] : __builtin_popcount(m_queued_mask & ((1 << chan) - 1));
+        dest[idx] = decodeTransaction(*trans);
+    }
+    MCP3008_STATS_RECORD(m_stats.wait, wait_start);
+    return ESP_OK;
+}
+
+esp_err_t Driver::readBusPolling(uint16_t* dest, uint8_t mask) const {
+    MCP3008_STATS_START(wait_start);
+    esp_err_t res = m_transport->acquireBus(portMAX_DELAY);
+    if (res != ESP_OK)
+        return res;
+
+    for (; mask != 0; mask &= mask - 1) {
+        auto& t = m_transactions[__builtin_ctz(mask)];
+        res = m_transport->pollingTransmit(&t);
+        if (res != ESP_OK)
+            break;
+
+        *dest++ = decodeTransaction(t);
+    }
+
+    m_transport->releaseBus();
+    MCP3008_STATS_RECORD(m_stats.wait, wait_start);
+    return res;
+}
+
+esp_err_t Driver::readFrames(uint16_t* dest, size_t frames, bool differential, uint32_t* samples_per_sec) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+    if (isSampling() || m_read_pending)
+        return ESP_ERR_INVALID_STATE;
+
+    const size_t total = frames * m_channels_count;
+    if (total == 0)
+        return ESP_OK;
+    if (total > BURST_SAMPLE_MASK)
+        return ESP_ERR_INVALID_SIZE;
+
+    const int64_t start = esp_timer_get_time();
+    esp_err_t res = ESP_OK;
+    if (m_polling) {
+        for (size_t i = 0; i < frames && res == ESP_OK; ++i) {
+            res = readBus(dest + i * m_channels_count, differential, m_channels_mask);
+        }
+    } else {
+        res = transferBurst(dest, total, m_channels, m_channels_count, nullptr, differential);
+    }
+
+    if (res == ESP_OK && samples_per_sec) {
+        const int64_t elapsed = std::max<int64_t>(1, esp_timer_get_time() - start);
+        *samples_per_sec = total * 1000000LL / elapsed;
+    }
+    return res;
+}
+
+esp_err_t Driver::transferBurst(uint16_t* dest, size_t total, const uint8_t* sequence, size_t sequence_len,
+    const uint32_t* user_flags, bool differential) const {
+    auto enqueue = [&](spi_transaction_t* t, size_t sample) -> esp_err_t {
+        prepareTransaction(*t, sequence[sample % sequence_len], differential);
+        t->user = (void*)(sample | (user_flags ? user_flags[sample] : 0));
+        return m_transport->queueTrans(t, portMAX_DELAY);
+    };
+
+    esp_err_t res = ESP_OK;
+    size_t queued = 0;
+    size_t in_flight = 0;
+    while (queued < total && queued < m_burst.size()) {
+        res = enqueue(&m_burst[queued], queued);
+        if (res != ESP_OK)
+            break;
+        ++queued;
+        ++in_flight;
+    }
+
+    while (in_flight != 0) {
+        spi_transaction_t* trans = NULL;
+        esp_err_t get_res = m_transport->getTransResult(&trans, portMAX_DELAY);
+        if (get_res != ESP_OK) {
+            res = get_res;
+            break;
+        }
+        --in_flight;
+
+        dest[(uintptr_t)trans->user & BURST_SAMPLE_MASK] = decodeTransaction(*trans);
+
+        if (res == ESP_OK && queued < total) {
+            res = enqueue(trans, queued);
+            if (res == ESP_OK) {
+                ++queued;
+                ++in_flight;
+            }
+        }
+    }
+    return res;
+}
+
+void IRAM_ATTR Driver::emitterPreCallback(spi_transaction_t* trans) {
+    const uint32_t user = (uintptr_t)trans->user;
+    if ((user & EMITTER_SET) == 0)
+        return;
+
+    // Straight to the registers, gpio_set_level() is in flash, which may be
+    // unavailable while this runs from the SPI interrupt, e.g. during NVS writes.
+    const int pin = (user >> EMITTER_PIN_SHIFT) & 0x3F;
+    const bool high = (user & EMITTER_LEVEL) != 0;
+    if (pin < 32) {
+        if (high)
+            GPIO.out_w1ts = uint32_t(1) << pin;
+        else
+            GPIO.out_w1tc = uint32_t(1) << pin;
+    } else {
+        if (high)
+            GPIO.out1_w1ts.val = uint32_t(1) << (pin - 32);
+        else
+            GPIO.out1_w1tc.val = uint32_t(1) << (pin - 32);
+    }
+}
+
+esp_err_t Driver::readAmbientCompensated(uint16_t* dest, bool differential, uint16_t* ambient) const {
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+    if (m_pin_emitter < 0)
+        return ESP_ERR_NOT_SUPPORTED;
+    if (isSampling() || m_read_pending)
+        return ESP_ERR_INVALID_STATE;
+    return readAmbientBus(dest, differential, ambient);
+}
+
+esp_err_t Driver::readAmbientBus(uint16_t* dest, bool differential, uint16_t* ambient) const {
+    const size_t total = m_emitter_sequence.size();
+    uint16_t* samples = m_emitter_samples.data();
+
+    esp_err_t res = ESP_OK;
+    if (m_polling) {
+        res = m_transport->acquireBus(portMAX_DELAY);
+        if (res != ESP_OK)
             return res;
+
+        auto& t = m_burst[0];
+        for (size_t i = 0; i < total && res == ESP_OK; ++i) {
+            prepareTransaction(t, m_emitter_sequence[i], differential);
+            t.user = (void*)(i | m_emitter_flags[i]);
+            res = m_transport->pollingTransmit(&t);
+            samples[i] = decodeTransaction(t);
         }
+        m_transport->releaseBus();
+    } else {
+        res = transferBurst(samples, total, m_emitter_sequence.data(), total, m_emitter_flags.data(), differential);
+    }
 
-        const int idx = (int)trans->user;
-        dest[idx] = ((trans->rx_data[1] & 0x03) << 8) | trans->rx_data[2];
+    if (res != ESP_OK) {
+        // The burst may have stopped with the emitters off
+        gpio_set_level(m_pin_emitter, m_emitter_on_level);
+        return res;
+    }
+
+    const uint16_t* dark = samples + m_emitter_settle;
+    const uint16_t* lit = dark + total / 2;
+    for (int i = 0; i < m_channels_count; ++i) {
+        dest[i] = lit[i] > dark[i] ? lit[i] - dark[i] : 0;
     }
+    if (ambient)
+        std::copy(dark, dark + m_channels_count, ambient);
     return ESP_OK;
 }
 
+Driver::Stats Driver::getStats() const {
+    Stats stats = {};
+#ifdef MCP3008_STATS
+    stats.queue = m_stats.queue.get();
+    stats.wait = m_stats.wait.get();
+    stats.calibration = m_stats.calibration.get();
+    stats.line = m_stats.line.get();
+#endif
+    return stats;
+}
+
+void Driver::resetStats() {
+#ifdef MCP3008_STATS
+    m_stats.queue.reset();
+    m_stats.wait.reset();
+    m_stats.calibration.reset();
+    m_stats.line.reset();
+#endif
+}
+
 uint16_t Driver::readChannel(uint8_t channel, bool differential, esp_err_t* result) const {
     if (!m_installed || channel >= CHANNELS) {
         if (result)
@@ -149,13 +761,37 @@ uint16_t Driver::readChannel(uint8_t channel, bool differential, esp_err_t* resu
         return 0xFFFF;
     }
 
-    spi_transaction_t trans = { 0 };
-    trans.flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA;
-    trans.length = 3 * 8;
-    trans.tx_data[0] = 1;
-    trans.tx_data[1] = (!differential << 7) | ((channel & 0x07) << 4);
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK) {
+        if (result)
+            *result = attached;
+        return 0xFFFF;
+    }
+
+    if (m_read_pending) {
+        if (result)
+            *result = ESP_ERR_INVALID_STATE;
+        return 0xFFFF;
+    }
+
+    if (isSampling()) {
+        if (differential != m_sampler_cfg.differential || ((1 << channel) & m_channels_mask) == 0) {
+            if (result)
+                *result = ESP_ERR_INVALID_STATE;
+            return 0xFFFF;
+        }
+
+        Frame frame;
+        m_latest.read(frame);
+        if (result)
+            *result = ESP_OK;
+        return frame.values[m_channel_index[channel]];
+    }
+
+    spi_transaction_t trans;
+    prepareTransaction(trans, channel, differential);
 
-    esp_err_t res = spi_device_transmit(m_spi, &trans);
+    esp_err_t res = m_polling ? m_transport->pollingTransmit(&trans) : m_transport->transmit(&trans);
     if (res != ESP_OK) {
         if (result)
             *result = res;
@@ -164,7 +800,7 @@ uint16_t Driver::readChannel(uint8_t channel, bool differential, esp_err_t* resu
 
     if (result)
         *result = ESP_OK;
-    return ((trans.rx_data[1] & 0x03) << 8) | trans.rx_data[2];
+    return decodeTransaction(trans);
 }
 
 }; // namespace mcp3008
@@ -1,21 +1,35 @@
 #pragma once
 
+#include <atomic>
 #include <driver/spi_master.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <vector>
 
+#include "mcp3008_snapshot.h"
+#include "mcp3008_stats.h"
+#include "mcp3008_transport.h"
+
 namespace mcp3008 {
 
 /**
  * \brief The MCP3008 driver.
  *
  * This class is not thread-safe, you have to make sure the methods are called
- * from one thread at a time only.
+ * from one thread at a time only. The only exceptions are readLatest() and
+ * getSamplingStats(), which can be called from any thread while the sampling task
+ * is running, see startSampling(). For several tasks sharing one sensor,
+ * let the sampling task own the chip and read its frames from the other tasks,
+ * without any mutex.
  * The install() method has to be called before you can use any other methods.
  */
 class Driver {
 public:
     static constexpr int CHANNELS = 8; //!< Amount of channels on the chip
     static constexpr uint16_t MAX_VAL = 1023; //!< Maximum value returned by from the chip (10bits).
+    static constexpr int COMPACT_FRAME_BITS = 17; //!< SPI clocks per conversion with Config::compact_framing.
 
     /**
      * \brief The Driver SPI configuration.
@@ -32,10 +46,30 @@ public:
             this->pin_mosi = pin_mosi;
             this->pin_miso = pin_miso;
             this->pin_sck = pin_sck;
+
+            this->polling = false;
+            this->dma_chan = -1;
+            this->lazy_install = false;
+            this->compact_framing = false;
+            this->queue_size = CHANNELS;
+            this->pin_emitter = gpio_num_t(-1);
+            this->emitter_on_level = 1;
+            this->emitter_settle = 1;
+            this->transport = nullptr;
+
+            this->max_freq = 0;
+            this->reference_channel = -1;
+            this->reference_value = 0;
+            this->freq_tolerance = 4;
         }
 
         int freq; //!< SPI communication frequency
         spi_host_device_t spi_dev; //!< Which ESP32 SPI device to use.
+            //!< Several Drivers can share one SPI device, each with their own \p pin_cs.
+            //!< The bus is initialized by the first one installed, so the other pins
+            //!< of the subsequent ones are ignored. If the bus was already initialized
+            //!< by another driver (SD card, display...), the Drivers only add their devices
+            //!< to it and leave freeing the bus to its owner.
         uint8_t channels_mask; //!< Which channels to use, bit mask:
             //!< (1 << 0) | (1 << 2) == channels 0 and 2 only.
 
@@ -43,6 +77,161 @@ public:
         gpio_num_t pin_mosi;
         gpio_num_t pin_miso;
         gpio_num_t pin_sck;
+
+        /**
+         * \brief Use polling SPI transactions instead of the queued, interrupt-based ones.
+         *
+         * The queued mode costs one interrupt and one FreeRTOS queue round-trip
+         * for each channel, which is more than the transfer itself at the default frequency.
+         * In polling mode, read() acquires the bus for the whole frame and busy-waits
+         * for each conversion instead, which makes the frame considerably shorter,
+         * but the calling task does not yield the CPU while the frame is being read.
+         * Run the `bench` PlatformIO environment to measure the difference on your board.
+         */
+        bool polling;
+
+        /**
+         * \brief DMA channel passed to spi_bus_initialize(), 0 to not use DMA.
+         *
+         * -1 (the default) selects a different channel for each host, see getDmaChannel(),
+         * because two SPI hosts cannot share one DMA channel.
+         * The conversions are at most 3 bytes long and always fit the SPI peripheral's
+         * own buffer, so they don't need DMA, and setting up the DMA descriptors
+         * costs a little on each transaction. Ignored if the bus is already initialized.
+         */
+        int dma_chan;
+
+        //! The DMA channel used for \p spi_dev, \p dma_chan or 1 for HSPI_HOST and 2 for VSPI_HOST.
+        int getDmaChannel() const { return dma_chan >= 0 ? dma_chan : (spi_dev == VSPI_HOST ? 2 : 1); }
+
+        /**
+         * \brief Postpone touching the SPI bus until the first read.
+         *
+         * install() then only prepares the Driver, and the bus is initialized (or the device
+         * added to it), the emitter pin set up and Config::max_freq tuned by the first read,
+         * readChannel(), startRead() or startSampling() call, which shortens the boot.
+         * That first call must not run concurrently with any other call to this Driver.
+         * If attaching fails, that call returns the error and the next one tries again.
+         */
+        bool lazy_install;
+
+        /**
+         * \brief Use 17 clocks per conversion instead of 24.
+         *
+         * By default, each conversion is three whole bytes with the start bit in the first one,
+         * as in the datasheet's 8-bit segment framing. In the compact framing, the start bit is sent
+         * on the first clock and the transaction ends right after B0, so a frame is about 30 %
+         * shorter at the same frequency. The ESP32 SPI master supports such bit lengths directly.
+         */
+        bool compact_framing;
+
+        /**
+         * \brief Depth of the SPI transaction queue, at least Driver::CHANNELS.
+         *
+         * Only readFrames() makes use of deeper queues, they allow it to keep
+         * the queue full across frame boundaries. Each queue slot costs sizeof(spi_transaction_t) of RAM.
+         */
+        int queue_size;
+
+        /**
+         * \brief GPIO which enables the sensors' light emitters, see readAmbientCompensated().
+         *
+         * -1 (the default) if the emitters are always on. install() turns the emitters on,
+         * and they stay on except for the ambient half of readAmbientCompensated().
+         * The pin is switched from the SPI driver's pre-transaction callback,
+         * right between two conversions. install() returns ESP_ERR_INVALID_ARG
+         * if it is set together with an empty \p channels_mask.
+         */
+        gpio_num_t pin_emitter;
+        uint8_t emitter_on_level; //!< Level of \p pin_emitter which turns the emitters on.
+        uint8_t emitter_settle; //!< Conversions discarded after each switch of the emitters, while the sensors settle.
+
+        /**
+         * \brief Talk to the chip through this transport instead of the SPI bus, e.g. ReplayTransport.
+         *
+         * If not null, install() does not touch the SPI bus, the pins and \p spi_dev are ignored.
+         * The transport must outlive the Driver.
+         */
+        Transport* transport;
+
+        /**
+         * \brief Highest frequency install() may select, see getFrequency().
+         *
+         * If higher than \p freq, install() steps the clock up from \p freq by 25 % at a time
+         * and checks the conversions at each step: the chip's null bit must be zero
+         * and the mean values must stay within \p freq_tolerance of the ones read at \p freq
+         * (or of \p reference_value). The highest frequency which passes is used.
+         * The sensors must not move during install() unless \p reference_channel is used.
+         * Ignored when \p transport is set.
+         */
+        int max_freq;
+        int8_t reference_channel; //!< Channel with a known, fixed input used by the \p max_freq check, -1 to check all the channels for consistency.
+        uint16_t reference_value; //!< Expected value of \p reference_channel, in range <0; Driver::MAX_VAL>.
+        uint16_t freq_tolerance; //!< Largest accepted difference of the mean values in the \p max_freq check.
+    };
+
+    /**
+     * \brief Configuration of the background sampling task, see startSampling().
+     */
+    struct SamplerConfig {
+        SamplerConfig(TickType_t period = 0, BaseType_t core = 0, UBaseType_t priority = 5,
+            bool differential = false, uint32_t stack_size = 2048) {
+            this->period = period;
+            this->core = core;
+            this->priority = priority;
+            this->differential = differential;
+            this->stack_size = stack_size;
+
+            this->period_us = 0;
+            this->ambient_compensation = false;
+        }
+
+        TickType_t period; //!< Sampling period in FreeRTOS ticks, 0 means sample continuously.
+
+        /**
+         * \brief Sampling period in microseconds, driven by an esp_timer. Overrides \p period if not 0.
+         *
+         * Unlike the tick-based \p period, this allows sub-millisecond periods and the frames
+         * start at a fixed time regardless of how long the previous one took.
+         * Use getSamplingStats() to check the achieved period and jitter.
+         */
+        uint32_t period_us;
+        BaseType_t core; //!< Which core to pin the sampling task to, or tskNO_AFFINITY.
+        UBaseType_t priority; //!< FreeRTOS priority of the sampling task.
+        bool differential; //!< Sample differential readings, see read().
+        bool ambient_compensation; //!< Sample using readAmbientCompensated(), requires Config::pin_emitter.
+        uint32_t stack_size; //!< Stack size of the sampling task, in bytes.
+    };
+
+    /**
+     * \brief One sampled set of values, see readLatest().
+     */
+    struct Frame {
+        int64_t timestamp; //!< esp_timer_get_time() at the start of the frame, in microseconds.
+        uint16_t values[CHANNELS]; //!< Values of the channels specified by Config::channels_mask, in the same format as read().
+    };
+
+    /**
+     * \brief Timing statistics of the sampling task, see getSamplingStats().
+     */
+    struct SamplingStats {
+        uint32_t frames; //!< Amount of frames sampled.
+        uint32_t missed; //!< Amount of timer periods skipped because the previous frame was not finished yet.
+        uint32_t period_min_us; //!< Shortest time between the starts of two consecutive frames.
+        uint32_t period_max_us; //!< Longest time between the starts of two consecutive frames.
+        uint32_t period_mean_us; //!< Average time between the starts of two consecutive frames.
+        uint32_t jitter_max_us; //!< Largest difference between the measured and the configured period,
+            //!< or between period_max_us and period_min_us when sampling continuously.
+    };
+
+    /**
+     * \brief Timing of the individual read stages, see getStats().
+     */
+    struct Stats {
+        TimingStats queue; //!< Queueing the SPI transactions of one frame.
+        TimingStats wait; //!< Waiting for the results of one frame, or the whole polling frame.
+        TimingStats calibration; //!< LineSensor's calibration of one frame.
+        TimingStats line; //!< LineSensor's line position computation.
     };
 
     Driver();
@@ -52,6 +241,8 @@ public:
      * \brief Initialize the SPI bus. Must be called before any other methods,
      *        otherwise they will return ESP_FAIL.
      *
+     * With Config::lazy_install, the bus is initialized by the first read instead.
+     *
      * \param cfg the SPI bus configuration.
      * \return ESP_OK or any error code encountered during the inialization.
      *         Will return ESP_FAIL if called when already installed.
@@ -67,6 +258,8 @@ public:
     esp_err_t uninstall();
 
     uint8_t getChannelsMask() const { return m_channels_mask; } //!< Get the channel mask, specified in Config::channels_mask
+    uint8_t getChannelsCount() const { return m_channels_count; } //!< Get the amount of channels enabled in Config::channels_mask
+    int getFrequency() const { return m_freq; } //!< Get the SPI frequency in use, Config::freq or the one selected by Config::max_freq
 
     /**
      * \brief Read values from the chip. Returns values in range <0; Driver::MAX_VAL>.
@@ -75,6 +268,8 @@ public:
      *        It will be unchanged unless the ESP_OK result is returned (except possibly its capacity).
      *        Between 0 and Driver::CHANNELS values are appended, depending on Config::channels_mask.
      * \param differential return differential readings, as specified in the MCP3008 datasheet.
+     *        Each channel in Config::channels_mask then selects the pair with the same DiffPair code,
+     *        see readDifferential().
      * \return ESP_OK or any error code encountered during reading.
      *         Will return ESP_FAIL if called when not installed.
      */
@@ -87,6 +282,101 @@ public:
      */
     esp_err_t read(uint16_t* dest, bool differential = false) const;
 
+    /**
+     * \brief Read only some of the channels, selected for this call only.
+     *
+     * Goes through the same queued (or polling) path as read(), so reading
+     * fewer channels makes the frame proportionally shorter.
+     *
+     * \param mask which channels to read, same format as Config::channels_mask.
+     *        While the sampling task is running, it must be a subset of Config::channels_mask.
+     * \param dest array MUST be big enough to accomodate all the channels in \p mask!
+     *        The values are written in the order of the channels, without gaps.
+     * \param differential return differential readings, as specified in the MCP3008 datasheet.
+     * \return ESP_OK or any error code encountered during reading.
+     *         Will return ESP_FAIL if called when not installed.
+     */
+    esp_err_t read(uint8_t mask, uint16_t* dest, bool differential = false) const;
+
+    /**
+     * \brief Start reading a frame without waiting for it, see finishRead().
+     *
+     * The conversions are queued to the SPI driver and run in the background,
+     * so the calling task can do other work in the meantime. The frame must be
+     * collected by finishRead() before any other read is made through this Driver,
+     * the other read methods return ESP_ERR_INVALID_STATE while a read is pending.
+     * In the Config::polling mode, the whole frame is read by finishRead() instead.
+     * While the sampling task is running, finishRead() returns the newest sampled frame.
+     * startSampling() fails while a read is pending.
+     *
+     * \param differential return differential readings, as specified in the MCP3008 datasheet.
+     * \return ESP_OK or any error code encountered during queueing, nothing is pending in that case.
+     *         Will return ESP_FAIL if called when not installed and ESP_ERR_INVALID_STATE
+     *         if the previous startRead() was not finished yet.
+     */
+    esp_err_t startRead(bool differential = false) const { return startReadMask(m_channels_mask, differential); }
+
+    /**
+     * \brief startRead() of only some channels, see read(uint8_t, uint16_t*, bool) const.
+     */
+    esp_err_t startReadMask(uint8_t mask, bool differential = false) const;
+
+    /**
+     * \brief Wait for the frame requested by startRead() and write it to \p dest.
+     *
+     * \param dest array MUST be big enough to accomodate all channels requested by startRead(),
+     *        the values are in the same format as read().
+     * \return ESP_OK or any error code encountered during reading.
+     *         Will return ESP_ERR_INVALID_STATE if there is no startRead() pending.
+     */
+    esp_err_t finishRead(uint16_t* dest) const;
+
+    bool isReadPending() const { return m_read_pending; } //!< Was startRead() called without finishRead()?
+
+    /**
+     * \brief Differential input configurations of the chip, the IN+ channel first.
+     *
+     * The values are the pair codes used by readDifferential(), which are the same
+     * as the channel numbers used by read() with differential = true.
+     */
+    enum DiffPair {
+        DIFF_CH0_CH1 = 0,
+        DIFF_CH1_CH0 = 1,
+        DIFF_CH2_CH3 = 2,
+        DIFF_CH3_CH2 = 3,
+        DIFF_CH4_CH5 = 4,
+        DIFF_CH5_CH4 = 5,
+        DIFF_CH6_CH7 = 6,
+        DIFF_CH7_CH6 = 7,
+    };
+
+    /**
+     * \brief Read several differential pairs in one burst, see DiffPair.
+     *
+     * The chip returns 0 whenever IN+ is below IN-, so both polarities of a pair
+     * are needed to get the signed difference, see readDifferentialSigned().
+     *
+     * \param pairs which pairs to read, bit mask of DiffPair codes:
+     *        (1 << DIFF_CH0_CH1) | (1 << DIFF_CH1_CH0) == both polarities of channels 0 and 1.
+     *        While the sampling task is running, it must be a subset of Config::channels_mask
+     *        and the task must sample differential readings.
+     * \param dest array of Driver::CHANNELS values, indexed by the DiffPair code.
+     *        Only the values of the requested pairs are written.
+     * \return ESP_OK or any error code encountered during reading, see read(uint8_t, uint16_t*, bool) const.
+     */
+    esp_err_t readDifferential(uint8_t pairs, uint16_t* dest) const;
+
+    /**
+     * \brief Read the signed difference of channel pairs, both polarities in one burst.
+     *
+     * \param pairs which channel pairs to read, bit mask: (1 << 0) == channels 0 and 1,
+     *        (1 << 1) == channels 2 and 3 and so on, up to (1 << 3).
+     * \param dest array of Driver::CHANNELS / 2 values, dest[i] is CH(2*i) - CH(2*i + 1)
+     *        in range <-Driver::MAX_VAL; Driver::MAX_VAL>. Only the values of the requested pairs are written.
+     * \return see readDifferential().
+     */
+    esp_err_t readDifferentialSigned(uint8_t pairs, int16_t* dest) const;
+
     /**
      * \brief Read a single channel from the chip. Returns value is in range <0; Driver::MAX_VAL>.
      *
@@ -96,16 +386,221 @@ public:
      */
     uint16_t readChannel(uint8_t channel, bool differential = false, esp_err_t* result = nullptr) const;
 
+    /**
+     * \brief Read several consecutive frames as fast as the chip allows.
+     *
+     * Unlike calling read() in a loop, the SPI queue is kept saturated
+     * across the frame boundaries, see Config::queue_size.
+     *
+     * \param dest array of at least \p frames * getChannelsCount() values.
+     *        The frames are written one after another, each in the same format as read().
+     * \param frames amount of frames to read.
+     * \param differential return differential readings, as specified in the MCP3008 datasheet.
+     * \param samples_per_sec if not null, the achieved amount of conversions per second is written here.
+     * \return ESP_OK or any error code encountered during reading.
+     *         Will return ESP_FAIL if called when not installed, ESP_ERR_INVALID_STATE
+     *         while the sampling task is running and ESP_ERR_INVALID_SIZE for more than 2^24 values.
+     */
+    esp_err_t readFrames(uint16_t* dest, size_t frames, bool differential = false, uint32_t* samples_per_sec = nullptr) const;
+
+    /**
+     * \brief Read the values with the ambient light subtracted.
+     *
+     * Reads one frame with the emitters off and one with them on (see Config::pin_emitter),
+     * in one pipelined burst, and returns the difference. Both frames together cost
+     * 2 * (getChannelsCount() + Config::emitter_settle) conversions, but only one queue round-trip.
+     *
+     * \param dest array MUST be big enough to accomodate all the channels specified by Config::channels_mask!
+     *        The values are in the same format as read(), clamped to 0 where the ambient light is stronger.
+     * \param differential return differential readings, as specified in the MCP3008 datasheet.
+     * \param ambient if not null, the values read with the emitters off are written here, in the same format.
+     * \return ESP_OK or any error code encountered during reading.
+     *         Will return ESP_FAIL if called when not installed, ESP_ERR_NOT_SUPPORTED without
+     *         Config::pin_emitter and ESP_ERR_INVALID_STATE while the sampling task is running.
+     */
+    esp_err_t readAmbientCompensated(uint16_t* dest, bool differential = false, uint16_t* ambient = nullptr) const;
+
+    /**
+     * \brief Start a background task which samples all channels specified
+     *        by Config::channels_mask.
+     *
+     * While the sampling is running, read() and readChannel() no longer talk to the chip,
+     * but return the newest sampled frame instead, without waiting for the SPI bus.
+     * They return ESP_ERR_INVALID_STATE when asked for differential readings
+     * and the sampler was not started with SamplerConfig::differential, or vice versa.
+     *
+     * This method returns after the first frame was sampled.
+     *
+     * \param cfg the sampling task configuration.
+     * \return ESP_OK or any error code encountered during the task creation.
+     *         Will return ESP_FAIL if called when not installed or already sampling.
+     */
+    esp_err_t startSampling(const SamplerConfig& cfg = SamplerConfig());
+
+    /**
+     * \brief Stop the background sampling task and wait for it to exit.
+     *
+     * \return ESP_OK, or ESP_FAIL if the sampling is not running.
+     */
+    esp_err_t stopSampling();
+
+    bool isSampling() const { return m_sampler_task.load() != nullptr; } //!< Is the background sampling task running?
+
+    /**
+     * \brief Copy the newest frame sampled by the background task.
+     *
+     * This method can be called from any number of tasks at the same time,
+     * it does not block and never waits for the SPI bus.
+     *
+     * \param frame the frame will be written here.
+     * \return sequence number of the frame, incremented with each sampled frame.
+     *         Returns 0 if the sampling is not running (\p frame is unchanged).
+     */
+    uint32_t readLatest(Frame& frame) const;
+
+    /**
+     * \brief Get the timing statistics of the sampling task.
+     *
+     * Like readLatest(), this can be called from any thread and does not block.
+     * The statistics are cleared by startSampling() and resetSamplingStats().
+     */
+    SamplingStats getSamplingStats() const;
+
+    void resetSamplingStats() { m_sampler_reset_stats.store(true); } //!< Clear the statistics returned by getSamplingStats().
+
+    /**
+     * \brief Get the CPU cycle timings of the read stages.
+     *
+     * The timings are only collected when the library is built with
+     * the MCP3008_STATS macro defined (e.g. `build_flags = -DMCP3008_STATS`),
+     * all of them are zero otherwise. The macro must be defined for every
+     * source file including this header, and costs nothing when not defined.
+     * The sampling task records into the same statistics, so the values
+     * may be slightly inconsistent when read while it is running.
+     */
+    Stats getStats() const;
+
+    void resetStats(); //!< Clear the statistics returned by getStats().
+
 protected:
     int requestToChannel(int request) const;
+    uint8_t channelAt(int idx) const { return m_channels[idx]; } //!< Unchecked requestToChannel(), idx must be < getChannelsCount()
+
+#ifdef MCP3008_STATS
+    struct StatsRecorder {
+        TimingHistogram queue;
+        TimingHistogram wait;
+        TimingHistogram calibration;
+        TimingHistogram line;
+    };
+
+    mutable StatsRecorder m_stats;
+#endif
+
+    /**
+     * \brief Read values from the chip over SPI, bypassing the sampling task.
+     *        See read(uint16_t*, bool) const.
+     */
+    esp_err_t readBus(uint16_t* dest, bool differential, uint8_t mask) const;
+
+    /**
+     * \brief First half of readBus(): queue the conversions of one frame and return.
+     *
+     * Must be followed by collectFrame() before any other read.
+     * If this returns an error, nothing stays queued.
+     */
+    esp_err_t queueFrame(bool differential, uint8_t mask) const;
+
+    /**
+     * \brief Second half of readBus(): wait for the conversions queued
+     *        by queueFrame() and write their results to \p dest.
+     */
+    esp_err_t collectFrame(uint16_t* dest) const;
+
+    /**
+     * \brief Called by the sampling task with each new frame, after it was published.
+     *
+     * Runs in the sampling task and may derive and publish more data from the frame,
+     * as LineSensor does. The default implementation does nothing.
+     */
+    virtual void onFrameSampled(const Frame& frame) {}
+
+    void prepareTransaction(spi_transaction_t& t, int channel, bool differential) const; //!< Fill in a conversion request for \p channel.
+    uint16_t decodeTransaction(const spi_transaction_t& t) const; //!< Extract the converted value from a finished transaction.
+    bool checkTransaction(const spi_transaction_t& t) const; //!< Is the chip's null bit in a finished transaction zero?
 
 private:
+    friend class LineSensorArray;
+
     Driver(const Driver&) = delete;
 
+    static void samplerTask(void* driver);
+    static void samplerTimerCallback(void* driver);
+
+    void prepareTransactions(bool differential) const;
+    esp_err_t readBusPolling(uint16_t* dest, uint8_t mask) const;
+    esp_err_t readAmbientBus(uint16_t* dest, bool differential, uint16_t* ambient) const;
+
+    esp_err_t tuneFrequency(const Config& cfg, spi_device_interface_config_t& devcfg);
+    esp_err_t setDeviceFrequency(spi_device_interface_config_t& devcfg, int freq);
+    esp_err_t measureChannels(uint8_t mask, uint16_t* means, bool& valid) const;
+
+    /**
+     * \brief Run \p total conversions, keeping the SPI queue full, in the queued mode only.
+     *
+     * \param sequence channel of each conversion, repeated every \p sequence_len conversions.
+     * \param user_flags emitter flags of each conversion, see emitterPreCallback(). May be null.
+     */
+    esp_err_t transferBurst(uint16_t* dest, size_t total, const uint8_t* sequence, size_t sequence_len,
+        const uint32_t* user_flags, bool differential) const;
+
+    static void emitterPreCallback(spi_transaction_t* trans);
+
+    esp_err_t attach(const Config& cfg); //!< The SPI part of install(), possibly deferred by Config::lazy_install.
+    esp_err_t ensureAttached() const; //!< ESP_FAIL if not installed, attach() if not done yet.
+
     spi_device_handle_t m_spi;
+    SpiTransport m_spi_transport;
+    Transport* m_transport; //!< Either m_spi_transport or Config::transport
     spi_host_device_t m_spi_dev;
     bool m_installed;
+    bool m_attached; //!< attach() succeeded, false until the first read with Config::lazy_install
+    Config m_attach_cfg; //!< Config for the deferred attach()
     uint8_t m_channels_mask;
+    uint8_t m_channels_count;
+    bool m_polling;
+    int m_freq;
+    bool m_compact_framing;
+    mutable std::vector<spi_transaction_t> m_burst; //!< Transactions used by readFrames()
+
+    // Prepared by prepareTransactions() and reused by each read,
+    // rebuilt only when the differential flag changes.
+    mutable spi_transaction_t m_transactions[CHANNELS];
+    mutable bool m_transactions_differential;
+    mutable int m_queued; //!< Transactions queued by queueFrame(), not collected yet
+    mutable uint8_t m_queued_mask; //!< Channels requested by the last queueFrame()
+    mutable bool m_read_pending; //!< startRead() was called, finishRead() was not yet
+    mutable bool m_pending_queued; //!< The pending startRead() queued its own frame, it was not sampling
+    mutable uint8_t m_pending_mask; //!< Channels requested by the pending startRead()
+    mutable bool m_pending_differential; //!< Differential flag of the pending startRead()
+    uint8_t m_channel_index[CHANNELS]; //!< Index of each channel in the read() results
+    uint8_t m_channels[CHANNELS]; //!< Channels enabled in m_channels_mask, m_channels_count of them
+
+    gpio_num_t m_pin_emitter;
+    uint8_t m_emitter_on_level;
+    uint8_t m_emitter_settle;
+    std::vector<uint8_t> m_emitter_sequence; //!< Channels of a readAmbientCompensated() burst
+    std::vector<uint32_t> m_emitter_flags; //!< Emitter switching of a readAmbientCompensated() burst
+    mutable std::vector<uint16_t> m_emitter_samples; //!< Results of a readAmbientCompensated() burst
+
+    std::atomic<TaskHandle_t> m_sampler_task; //!< Also read by samplerTimerCallback(), which can outlive esp_timer_stop()
+    SemaphoreHandle_t m_sampler_done; //!< Given by the sampling task when it exits
+    std::atomic<bool> m_sampler_stop;
+    std::atomic<bool> m_sampler_reset_stats;
+    esp_timer_handle_t m_sampler_timer;
+    SamplerConfig m_sampler_cfg;
+    SnapshotBuffer<Frame> m_latest;
+    SnapshotBuffer<SamplingStats> m_sampler_stats;
 };
 
 }; // namespace mcp3008
@@ -0,0 +1,119 @@
+#include <algorithm>
+
+#include "mcp3008_line_analysis.h"
+
+namespace mcp3008 {
+
+static int16_t centroidPosition(uint32_t weighted, uint32_t sum, size_t count) {
+    const int32_t middle = int32_t(count - 1) * Driver::MAX_VAL / 2;
+    if (middle == 0 || sum == 0)
+        return 0;
+
+    const int32_t result = int32_t(weighted / sum) - middle;
+    return std::min<int32_t>(LineAnalysis::LINE_MAX, std::max<int32_t>(-LineAnalysis::LINE_MAX, result * LineAnalysis::LINE_MAX / middle));
+}
+
+void LineAnalysis::analyze(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) {
+    position = LINE_NOT_FOUND;
+    confidence = 0;
+    flags = 0;
+    width = 0;
+    main_segment = 0;
+    segment_count = 0;
+    if (count == 0)
+        return;
+
+    uint16_t min = Driver::MAX_VAL;
+    uint16_t max = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint16_t val = white_line ? Driver::MAX_VAL - vals[i] : vals[i];
+        min = std::min(min, val);
+        max = std::max(max, val);
+    }
+
+    // A channel is on the line only if it is strictly above the cut below, which is
+    // at least line_threshold, so both tests are strict to leave the peak always above it.
+    confidence = max - min;
+    if (max <= line_threshold)
+        return;
+
+    // Without enough contrast the sensors are either all on the line,
+    // or the frame is just noise, which the threshold above filters out.
+    if (max - min <= line_threshold)
+        min = 0;
+
+    const uint16_t range = max - min;
+    confidence = range;
+
+    // The weights are the values above this level, so the centroid does not jump
+    // when a channel joins or leaves a segment.
+    const uint16_t cut = std::max<uint16_t>(line_threshold, range / 4);
+
+    LineSegment* segment = nullptr;
+    uint32_t weighted = 0;
+    uint32_t sum = 0;
+    uint32_t best_sum = 0;
+    size_t on_count = 0;
+
+    // One extra iteration closes the last segment
+    for (size_t i = 0; i <= count; ++i) {
+        uint16_t val = 0;
+        if (i < count) {
+            val = (white_line ? Driver::MAX_VAL - vals[i] : vals[i]) - min;
+        }
+
+        if (val > cut) {
+            ++on_count;
+            if (segment == nullptr) {
+                if (segment_count == MAX_SEGMENTS)
+                    continue;
+                segment = &segments[segment_count];
+                segment->start = i;
+                segment->peak = i;
+                segment->peak_value = 0;
+                weighted = 0;
+                sum = 0;
+            }
+            if (val > segment->peak_value) {
+                segment->peak = i;
+                segment->peak_value = val;
+            }
+            weighted += uint32_t(val - cut) * i * Driver::MAX_VAL;
+            sum += val - cut;
+        } else if (segment != nullptr) {
+            segment->end = i - 1;
+            segment->centroid = centroidPosition(weighted, sum, count);
+            if (sum > best_sum) {
+                best_sum = sum;
+                main_segment = segment_count;
+            }
+            ++segment_count;
+            segment = nullptr;
+        }
+    }
+
+    if (segment_count == 0)
+        return;
+
+    const LineSegment& main = segments[main_segment];
+    position = main.centroid;
+    width = main.end - main.start + 1;
+
+    if (segment_count > 1)
+        flags |= MULTIPLE_LINES;
+    if (on_count == count)
+        flags |= FULL_WIDTH;
+
+    const size_t wide = (count + 1) / 2;
+    for (int s = 0; s < segment_count; ++s) {
+        const LineSegment& seg = segments[s];
+        if (size_t(seg.end - seg.start + 1) < wide)
+            continue;
+        if (seg.start == 0)
+            flags |= JUNCTION_LEFT;
+        if (seg.end == count - 1)
+            flags |= JUNCTION_RIGHT;
+    }
+}
+
+}; // namespace mcp3008
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mcp3008_driver.h"
+
+namespace mcp3008 {
+
+/**
+ * \brief One continuous run of channels under a line, see LineAnalysis.
+ */
+struct LineSegment {
+    uint8_t start; //!< Index of the first value in the segment.
+    uint8_t end; //!< Index of the last value in the segment.
+    uint8_t peak; //!< Index of the strongest value in the segment.
+    uint16_t peak_value; //!< Strongest value above the background, in range <0; Driver::MAX_VAL>.
+    int16_t centroid; //!< Position of the segment, in the same format as LineSensor::readLineFixed().
+};
+
+/**
+ * \brief Detailed analysis of one calibrated frame, see LineSensor::readLineAnalysis().
+ *
+ * Unlike LineSensor::readLineFixed(), which averages everything under the sensors
+ * into one position, the channels are split into separate segments, so crossings,
+ * forks and corners can be told apart from a single line.
+ * A channel belongs to a segment if its value above the background (the weakest channel)
+ * is over the line threshold and over a quarter of the contrast. The centroids are
+ * weighted by the values above that level, so the positions move smoothly
+ * as the channels join or leave the segments. When all the channels are on the line,
+ * the background is taken as 0, and the result is one FULL_WIDTH segment.
+ *
+ * The result has a fixed size and analyze() does not allocate, it does two passes
+ * over the values, about the same work as LineSensor::computeLineFixed().
+ */
+struct LineAnalysis {
+    static constexpr int16_t LINE_MAX = 32767; //!< Same as LineSensor::LINE_MAX.
+    static constexpr int16_t LINE_NOT_FOUND = INT16_MIN; //!< Same as LineSensor::LINE_NOT_FOUND.
+    static constexpr int MAX_SEGMENTS = (Driver::CHANNELS + 1) / 2; //!< Most segments a frame can have, with gaps between them.
+
+    enum Flags {
+        MULTIPLE_LINES = 0x01, //!< More than one segment, e.g. a fork or a crossing seen from the side.
+        JUNCTION_LEFT = 0x02, //!< A segment at least half of the channels wide reaches the first channel, e.g. a corner.
+        JUNCTION_RIGHT = 0x04, //!< Same as JUNCTION_LEFT, but reaching the last channel.
+        FULL_WIDTH = 0x08, //!< All the channels are on the line, e.g. a crossing or a stop marker.
+    };
+
+    /**
+     * \brief Analyze one frame, overwriting all the fields.
+     *
+     * \param vals calibrated values, as returned by LineSensor::calibratedRead().
+     * \param count amount of values in \p vals. Segments after the first MAX_SEGMENTS are ignored.
+     * \param white_line see LineSensor::readLineFixed().
+     * \param line_threshold see LineSensor::readLineFixed().
+     */
+    void analyze(const uint16_t* vals, size_t count, bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5);
+
+    bool found() const { return segment_count != 0; } //!< Is there any line under the sensors?
+
+    int16_t position; //!< Centroid of the main segment, LINE_NOT_FOUND if there is no line.
+    uint16_t confidence; //!< Contrast between the strongest channel and the background, in range <0; Driver::MAX_VAL>.
+    uint8_t flags; //!< Combination of Flags.
+    uint8_t width; //!< Amount of channels in the main segment.
+    uint8_t main_segment; //!< Index of the segment with the most weight, its centroid is the position.
+    uint8_t segment_count; //!< Amount of valid entries in segments.
+    LineSegment segments[MAX_SEGMENTS]; //!< Segments, ordered by the channel index.
+};
+
+}; // namespace mcp3008
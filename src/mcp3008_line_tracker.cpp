@@ -0,0 +1,143 @@
+#include <algorithm>
+
+#include "mcp3008_line_tracker.h"
+
+namespace mcp3008 {
+
+LineTracker::LineTracker(bool white_line, uint16_t line_threshold, uint8_t window, uint8_t full_scan_interval)
+    : m_white_line(white_line)
+    , m_threshold(line_threshold)
+    , m_window(window)
+    , m_full_scan_interval(full_scan_interval) {
+    reset();
+}
+
+void LineTracker::reset() {
+    m_tracking = false;
+    m_seen = false;
+    m_since_full_scan = 0;
+    m_center = 0;
+    m_background = 0;
+    m_last = 0;
+}
+
+LineTracker::Result LineTracker::update(const uint16_t* vals, size_t count) {
+    Result result;
+    if (updateWindow(vals, count, result))
+        return result;
+    return updateFull(vals, count);
+}
+
+void LineTracker::getWindow(size_t count, size_t& lo, size_t& hi) const {
+    lo = m_center > m_window ? m_center - m_window : 0;
+    hi = std::min<size_t>(count - 1, m_center + m_window);
+}
+
+bool LineTracker::updateWindow(const uint16_t* vals, size_t count, Result& result) {
+    if (!isTracking() || !updateTracked(vals, count, result))
+        return false;
+    ++m_since_full_scan;
+    return true;
+}
+
+bool LineTracker::updateTracked(const uint16_t* vals, size_t count, Result& result) {
+    size_t lo, hi;
+    getWindow(count, lo, hi);
+
+    uint16_t max = 0;
+    size_t peak = lo;
+    for (size_t i = lo; i <= hi; ++i) {
+        const uint16_t val = value(vals, i);
+        if (val > max) {
+            max = val;
+            peak = i;
+        }
+    }
+
+    // The line is too faint, or moving out of the window
+    const uint16_t contrast = max > m_background ? max - m_background : 0;
+    if (max < m_threshold || contrast < m_threshold)
+        return false;
+    if ((peak == lo && lo != 0) || (peak == hi && hi != count - 1))
+        return false;
+
+    uint32_t weighted = 0;
+    uint32_t sum = 0;
+    for (size_t i = lo; i <= hi; ++i) {
+        const uint16_t val = value(vals, i);
+        if (val <= m_background)
+            continue;
+        weighted += uint32_t(val - m_background) * i * Driver::MAX_VAL;
+        sum += val - m_background;
+    }
+
+    result.full_scan = false;
+    found(weighted, sum, count, contrast, result);
+    return true;
+}
+
+LineTracker::Result LineTracker::updateFull(const uint16_t* vals, size_t count) {
+    m_since_full_scan = 0;
+
+    uint16_t min = Driver::MAX_VAL;
+    uint16_t max = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint16_t val = value(vals, i);
+        min = std::min(min, val);
+        max = std::max(max, val);
+    }
+
+    Result result;
+    result.full_scan = true;
+
+    const uint16_t range = max - min;
+    if (count == 0 || max < m_threshold || range < m_threshold || range == 0) {
+        m_tracking = false;
+        result.confidence = count == 0 ? 0 : range;
+        if (!m_seen) {
+            result.position = LINE_NOT_FOUND;
+            result.state = LINE_NEVER_SEEN;
+        } else if (m_last < 0) {
+            result.position = -LINE_MAX;
+            result.state = LINE_LOST_LEFT;
+        } else {
+            result.position = LINE_MAX;
+            result.state = LINE_LOST_RIGHT;
+        }
+        return result;
+    }
+
+    // Normalizing the values by the range is not needed,
+    // the centroid does not change with the scale.
+    uint32_t weighted = 0;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint16_t val = value(vals, i) - min;
+        weighted += uint32_t(val) * i * Driver::MAX_VAL;
+        sum += val;
+    }
+
+    m_background = min;
+    found(weighted, sum, count, range, result);
+    return result;
+}
+
+void LineTracker::found(uint32_t weighted, uint32_t sum, size_t count, uint16_t confidence, Result& result) {
+    const int32_t middle = int32_t(count - 1) * Driver::MAX_VAL / 2;
+    const int32_t centroid = sum != 0 ? weighted / sum : middle;
+
+    int32_t position = 0;
+    if (middle != 0)
+        position = std::min<int32_t>(LINE_MAX, std::max<int32_t>(-LINE_MAX, (centroid - middle) * LINE_MAX / middle));
+
+    m_tracking = true;
+    m_seen = true;
+    m_center = (centroid + Driver::MAX_VAL / 2) / Driver::MAX_VAL;
+    m_last = position;
+
+    result.position = position;
+    result.state = LINE_FOUND;
+    result.confidence = confidence;
+}
+
+}; // namespace mcp3008
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mcp3008_driver.h"
+
+namespace mcp3008 {
+
+/**
+ * \brief Stateful line position tracking, see LineSensor::readLineTracked().
+ *
+ * Once the line is found by a full scan over all the channels, the following
+ * frames compute the position only from a small window of channels around
+ * the previous position. The tracker falls back to a full scan when the line
+ * gets too faint or reaches the edge of the window, and periodically,
+ * so that it does not lock onto noise.
+ *
+ * When the line is lost, the tracker reports on which side it was seen last,
+ * instead of returning LineSensor::LINE_NOT_FOUND.
+ *
+ * The positions are in the same Q15 format as LineSensor::readLineFixed().
+ */
+class LineTracker {
+public:
+    enum State {
+        LINE_FOUND, //!< The line is under the sensors.
+        LINE_LOST_LEFT, //!< The line is lost, last seen under the channel with the smallest ID.
+        LINE_LOST_RIGHT, //!< The line is lost, last seen under the channel with the greatest ID.
+        LINE_NEVER_SEEN, //!< The line was not found since the creation or reset() of this tracker.
+    };
+
+    struct Result {
+        int16_t position; //!< See LineSensor::readLineFixed(). -LINE_MAX/LINE_MAX when lost to the left/right,
+            //!< LineSensor::LINE_NOT_FOUND if never seen.
+        State state;
+        uint16_t confidence; //!< Contrast between the line and the background, in range <0; Driver::MAX_VAL>.
+        bool full_scan; //!< This result was computed from all the channels, not just the window.
+    };
+
+    static constexpr int16_t LINE_MAX = 32767; //!< Same as LineSensor::LINE_MAX.
+    static constexpr int16_t LINE_NOT_FOUND = INT16_MIN; //!< Same as LineSensor::LINE_NOT_FOUND.
+
+    /**
+     * \param white_line the line is white on black background, see LineSensor::readLine().
+     * \param line_threshold minimal value and contrast of the line, in range <0; Driver::MAX_VAL>,
+     *        see LineSensor::readLineFixed().
+     * \param window amount of channels on each side of the previous position used while tracking.
+     * \param full_scan_interval do a full scan at least every this many frames.
+     */
+    LineTracker(bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5,
+        uint8_t window = 1, uint8_t full_scan_interval = 16);
+
+    void reset(); //!< Forget the last position, the next update() does a full scan.
+
+    /**
+     * \brief Compute the line position from a new frame.
+     *
+     * \param vals calibrated values, as returned by LineSensor::calibratedRead().
+     * \param count amount of values in \p vals, must be the same for all the calls.
+     */
+    Result update(const uint16_t* vals, size_t count);
+
+    /**
+     * \brief Does the next update() only need the channels from getWindow()?
+     */
+    bool isTracking() const { return m_tracking && m_since_full_scan < m_full_scan_interval; }
+
+    /**
+     * \brief Get the range of values used by the next update() while isTracking().
+     *
+     * \param count amount of values passed to update().
+     * \param lo index of the first value used.
+     * \param hi index of the last value used.
+     */
+    void getWindow(size_t count, size_t& lo, size_t& hi) const;
+
+    /**
+     * \brief Same as update(), but only the values from getWindow() have to be valid.
+     *
+     * \return false and leave \p result unchanged if a full scan is needed instead,
+     *         call update() with all the values then.
+     */
+    bool updateWindow(const uint16_t* vals, size_t count, Result& result);
+
+    int16_t getLastPosition() const { return m_last; } //!< Last position where the line was found.
+
+private:
+    uint16_t value(const uint16_t* vals, size_t i) const { return m_white_line ? Driver::MAX_VAL - vals[i] : vals[i]; }
+
+    bool updateTracked(const uint16_t* vals, size_t count, Result& result);
+    Result updateFull(const uint16_t* vals, size_t count);
+    void found(uint32_t weighted, uint32_t sum, size_t count, uint16_t confidence, Result& result);
+
+    const bool m_white_line;
+    const uint16_t m_threshold;
+    const uint8_t m_window;
+    const uint8_t m_full_scan_interval;
+
+    bool m_tracking;
+    bool m_seen;
+    uint8_t m_since_full_scan;
+    uint8_t m_center; //!< Index of the channel under the line in the last frame
+    uint16_t m_background; //!< Darkest value found by the last full scan
+    int16_t m_last;
+};
+
+}; // namespace mcp3008
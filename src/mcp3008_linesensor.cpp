@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <esp_log.h>
 
@@ -8,14 +9,30 @@
 namespace mcp3008 {
 
 LineSensor::LineSensor()
-    : Driver() {
+    : Driver()
+    , m_active_tables(0)
+    , m_table_readers { { 0 }, { 0 } }
+    , m_saving_calibration(false)
+    , m_save_result(ESP_OK)
+    , m_filter_frames(0)
+    , m_line_estimator(LINE_CENTROID)
+    , m_sampled_white_line(false)
+    , m_sampled_line_threshold(Driver::MAX_VAL / 5)
+    , m_telemetry(nullptr) {
+    CalibrationTables& t = m_tables[0];
     for (int i = 0; i < Driver::CHANNELS; ++i) {
-        m_calibration.min[i] = 0;
-        m_calibration.range[i] = Driver::MAX_VAL;
+        t.data.min[i] = 0;
+        t.data.range[i] = Driver::MAX_VAL;
     }
+    t.mode = CALIBRATION_RECIPROCAL;
+    updateCalibrationTables(t);
+    m_tables[1] = t;
 }
 
 LineSensor::~LineSensor() {
+    // The saving task reports its result here
+    while (m_saving_calibration.load())
+        vTaskDelay(1);
 }
 
 LineSensorCalibrator LineSensor::startCalibration() {
@@ -23,21 +40,108 @@ LineSensorCalibrator LineSensor::startCalibration() {
 }
 
 float LineSensor::readLine(bool white_line, float line_threshold) const {
-    std::vector<uint16_t> vals;
+    const int16_t pos = readLineFixed(white_line, line_threshold * MAX_VAL);
+    return pos == LINE_NOT_FOUND ? nanf("") : float(pos) / LINE_MAX;
+}
+
+float LineSensor::computeLine(const uint16_t* vals, size_t count, bool white_line, float line_threshold) {
+    const int16_t pos = computeLineFixed(vals, count, white_line, line_threshold * MAX_VAL);
+    return pos == LINE_NOT_FOUND ? nanf("") : float(pos) / LINE_MAX;
+}
+
+int16_t LineSensor::readLineFixed(bool white_line, uint16_t line_threshold) const {
+    uint16_t vals[Driver::CHANNELS];
     auto res = this->calibratedRead(vals);
-    if (res != ESP_OK || vals.size() == 0) {
+    if (res != ESP_OK || getChannelsCount() == 0) {
         ESP_LOGE(TAG, "read() failed: %d", res);
-        return nanf("");
+        return LINE_NOT_FOUND;
     }
 
-    uint32_t weighted = 0;
-    uint16_t sum = 0;
+    MCP3008_STATS_START(line_start);
+    const int16_t pos = estimateLine(vals, getChannelsCount(), white_line, line_threshold);
+    MCP3008_STATS_RECORD(m_stats.line, line_start);
+    return pos;
+}
+
+int16_t LineSensor::estimateLine(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) const {
+    if (m_line_estimator == LINE_CENTROID)
+        return computeLineFixed(vals, count, white_line, line_threshold);
+    return estimatePeak(vals, count, white_line, line_threshold);
+}
+
+namespace {
+
+// Position of each result index and the distance between two of them, for every channel count.
+// Built at compile time, so estimatePeak() neither writes any state nor divides to get them.
+struct LinePositions {
+    int16_t pos[Driver::CHANNELS + 1][Driver::CHANNELS];
+    int32_t step[Driver::CHANNELS + 1];
+
+    constexpr LinePositions()
+        : pos {}
+        , step {} {
+        for (int32_t count = 1; count <= Driver::CHANNELS; ++count) {
+            const int32_t span = count - 1;
+            for (int32_t i = 0; i < count; ++i) {
+                pos[count][i] = span == 0 ? 0 : -LineSensor::LINE_MAX + (2 * LineSensor::LINE_MAX * i + span / 2) / span;
+            }
+            step[count] = span == 0 ? 0 : (2 * LineSensor::LINE_MAX + span / 2) / span;
+        }
+    }
+};
+
+constexpr LinePositions LINE_POSITIONS;
+
+}
 
-    const uint16_t threshold = line_threshold * MAX_VAL;
+int16_t LineSensor::estimatePeak(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) const {
+    uint16_t min = Driver::MAX_VAL;
+    uint16_t max = 0;
+    size_t peak = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint16_t val = white_line ? MAX_VAL - vals[i] : vals[i];
+        if (val < min)
+            min = val;
+        if (val > max) {
+            max = val;
+            peak = i;
+        }
+    }
 
+    const uint16_t range = max - min;
+    if (max < line_threshold || range < line_threshold || range == 0)
+        return LINE_NOT_FOUND;
+
+    const int16_t* positions = LINE_POSITIONS.pos[count];
+    const int32_t step = LINE_POSITIONS.step[count];
+
+    auto neighbour = [&](size_t i) -> int32_t {
+        if (i >= count)
+            return 0;
+        return (white_line ? MAX_VAL - vals[i] : vals[i]) - min;
+    };
+
+    const int32_t left = neighbour(peak - 1);
+    const int32_t center = range;
+    const int32_t right = neighbour(peak + 1);
+
+    int32_t offset;
+    if (m_line_estimator == LINE_PARABOLIC) {
+        // Vertex of the parabola through (-1, left), (0, center) and (1, right)
+        const int32_t curvature = 2 * (left - 2 * center + right);
+        offset = curvature == 0 ? 0 : step * (left - right) / curvature;
+    } else {
+        offset = step * (right - left) / (left + center + right);
+    }
+
+    const int32_t result = positions[peak] + offset;
+    return std::min<int32_t>(LINE_MAX, std::max<int32_t>(-LINE_MAX, result));
+}
+
+int16_t LineSensor::computeLineFixed(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) {
     uint16_t min = MAX_VAL;
     uint16_t max = 0;
-    for (size_t i = 0; i < vals.size(); ++i) {
+    for (size_t i = 0; i < count; ++i) {
         auto val = vals[i];
         if (white_line)
             val = MAX_VAL - val;
@@ -49,27 +153,84 @@ float LineSensor::readLine(bool white_line, float line_threshold) const {
     }
 
     const uint16_t range = max - min;
-    if (max < threshold || range < threshold)
-        return nanf("");
+    if (max < line_threshold || range < line_threshold || range == 0)
+        return LINE_NOT_FOUND;
 
-    for (size_t i = 0; i < vals.size(); ++i) {
+    // Same rounded-up reciprocal as in calibrateValue(), exact for 10-bit values.
+    const uint32_t gain = ((uint64_t(MAX_VAL) << GAIN_SHIFT) + range - 1) / range;
+
+    uint32_t weighted = 0;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
         auto val = vals[i];
         if (white_line)
             val = MAX_VAL - val;
 
-        val = float(val - min) / range * MAX_VAL;
-
-        weighted += uint32_t(val) * i * MAX_VAL;
-        sum += val;
+        const uint32_t normalized = (uint32_t(val - min) * gain) >> GAIN_SHIFT;
+        weighted += normalized * i * MAX_VAL;
+        sum += normalized;
     }
 
     if (sum == 0)
-        return nanf("");
+        return LINE_NOT_FOUND;
 
-    const int16_t middle = float(vals.size() - 1) / 2 * MAX_VAL;
-    const int16_t result = (weighted / sum) - middle;
+    const int32_t middle = int32_t(count - 1) * MAX_VAL / 2;
+    if (middle == 0)
+        return 0;
+
+    const int32_t result = int32_t(weighted / sum) - middle;
+    return std::min<int32_t>(LINE_MAX, std::max<int32_t>(-LINE_MAX, result * LINE_MAX / middle));
+}
+
+esp_err_t LineSensor::readLineAnalysis(LineAnalysis& result, bool white_line, uint16_t line_threshold) const {
+    uint16_t vals[Driver::CHANNELS];
+    const auto res = this->calibratedRead(vals);
+    if (res != ESP_OK)
+        return res;
+
+    MCP3008_STATS_START(line_start);
+    result.analyze(vals, getChannelsCount(), white_line, line_threshold);
+    MCP3008_STATS_RECORD(m_stats.line, line_start);
+    return ESP_OK;
+}
+
+LineTracker::Result LineSensor::readLineTracked(LineTracker& tracker) const {
+    const int count = getChannelsCount();
+    uint16_t vals[Driver::CHANNELS];
+    LineTracker::Result result;
+
+    if (tracker.isTracking()) {
+        size_t lo, hi;
+        tracker.getWindow(count, lo, hi);
+
+        uint8_t mask = 0;
+        for (size_t i = lo; i <= hi; ++i) {
+            mask |= 1 << channelAt(i);
+        }
+
+        // The channels are in ascending order, so the window lands at vals[lo..hi]
+        if (calibratedRead(mask, vals + lo) == ESP_OK) {
+            MCP3008_STATS_START(line_start);
+            const bool tracked = tracker.updateWindow(vals, count, result);
+            MCP3008_STATS_RECORD(m_stats.line, line_start);
+            if (tracked)
+                return result;
+        }
+    }
+
+    auto res = this->calibratedRead(vals);
+    if (res != ESP_OK || getChannelsCount() == 0) {
+        ESP_LOGE(TAG, "read() failed: %d", res);
+        result = LineTracker::Result();
+        result.position = LINE_NOT_FOUND;
+        result.state = LineTracker::LINE_NEVER_SEEN;
+        return result;
+    }
 
-    return std::min(1.f, std::max(-1.f, float(result) / float(middle)));
+    MCP3008_STATS_START(line_start);
+    result = tracker.update(vals, count);
+    MCP3008_STATS_RECORD(m_stats.line, line_start);
+    return result;
 }
 
 bool LineSensor::setCalibration(const LineSensor::CalibrationData& data) {
@@ -83,51 +244,229 @@ bool LineSensor::setCalibration(const LineSensor::CalibrationData& data) {
         }
     }
 
-    m_calibration = data;
+    swapCalibration(data, getCalibrationMode());
     return true;
 }
 
-void LineSensor::calibrateResults(uint16_t* dest) const {
-    const auto mask = getChannelsMask();
-    int resIdx = 0;
+void LineSensor::setCalibrationMode(CalibrationMode mode) {
+    if (mode == getCalibrationMode())
+        return;
+    swapCalibration(getCalibration(), mode);
+}
+
+void LineSensor::swapCalibration(const CalibrationData& data, CalibrationMode mode) {
+    const uint8_t next = !m_active_tables.load(std::memory_order_relaxed);
+
+    // A frame may still be calibrated with the tables from before the previous swap
+    while (m_table_readers[next].load() != 0)
+        vTaskDelay(1);
+
+    CalibrationTables& t = m_tables[next];
+    t.data = data;
+    t.mode = mode;
+    updateCalibrationTables(t);
+    m_active_tables.store(next);
+}
+
+void LineSensor::updateCalibrationTables(CalibrationTables& t) {
     for (int chan = 0; chan < CHANNELS; ++chan) {
-        if (((1 << chan) & mask) == 0)
-            continue;
-        dest[resIdx] = calibrateValue(chan, dest[resIdx]);
-        ++resIdx;
+        const uint32_t range = t.data.range[chan];
+        // Channels with zero range always return either 0 or MAX_VAL, the gain is unused.
+        t.gain[chan] = range == 0 ? 0 : ((uint64_t(MAX_VAL) << GAIN_SHIFT) + range - 1) / range;
+    }
+
+    if (t.mode != CALIBRATION_LUT) {
+        std::vector<uint16_t>().swap(t.lut);
+        return;
+    }
+
+    t.lut.resize(CHANNELS * (MAX_VAL + 1));
+    for (int chan = 0; chan < CHANNELS; ++chan) {
+        uint16_t* table = t.lut.data() + chan * (MAX_VAL + 1);
+        for (int val = 0; val <= MAX_VAL; ++val) {
+            table[val] = calibrateReciprocal(t, chan, val);
+        }
     }
 }
 
-uint16_t LineSensor::calibrateValue(int chan, uint16_t val) const {
-    if (val <= m_calibration.min[chan]) {
+void LineSensor::calibrateResults(uint16_t* dest) const {
+    MCP3008_STATS_START(calibration_start);
+    const TablesLock lock(*this);
+    const CalibrationTables& t = *lock;
+    const int count = getChannelsCount();
+    if (t.mode == CALIBRATION_LUT) {
+        for (int i = 0; i < count; ++i) {
+            dest[i] = t.lut[channelAt(i) * (MAX_VAL + 1) + (dest[i] & MAX_VAL)];
+        }
+    } else {
+        for (int i = 0; i < count; ++i) {
+            dest[i] = calibrateReciprocal(t, channelAt(i), dest[i]);
+        }
+    }
+    MCP3008_STATS_RECORD(m_stats.calibration, calibration_start);
+}
+
+esp_err_t LineSensor::startSampling(const SamplerConfig& cfg, bool white_line, uint16_t line_threshold) {
+    if (isSampling())
+        return ESP_FAIL;
+
+    m_sampled_white_line = white_line;
+    m_sampled_line_threshold = line_threshold;
+    return Driver::startSampling(cfg);
+}
+
+uint32_t LineSensor::readLatestLine(LineFrame& frame) const {
+    if (!isSampling())
         return 0;
+    return m_latest_line.read(frame);
+}
+
+void LineSensor::onFrameSampled(const Frame& frame) {
+    LineFrame line;
+    line.timestamp = frame.timestamp;
+    std::copy(frame.values, frame.values + getChannelsCount(), line.values);
+    calibrateResults(line.values);
+    line.line = estimateLine(line.values, getChannelsCount(), m_sampled_white_line, m_sampled_line_threshold);
+    m_latest_line.publish(line);
+
+    if (m_telemetry) {
+        TelemetryRecord record = {};
+        record.timestamp = frame.timestamp;
+        std::copy(frame.values, frame.values + getChannelsCount(), record.raw);
+        std::copy(line.values, line.values + getChannelsCount(), record.calibrated);
+        record.line = line.line;
+        m_telemetry->push(record);
+    }
+}
+
+esp_err_t LineSensor::setTelemetry(TelemetryRing* ring) {
+    if (isSampling())
+        return ESP_ERR_INVALID_STATE;
+    m_telemetry = ring;
+    return ESP_OK;
+}
+
+void LineSensor::setFilter(const FilterConfig& cfg) {
+    m_filter = cfg;
+    m_filter.oversample = std::max<uint8_t>(1, cfg.oversample);
+    m_filter.ema_shift = std::min<uint8_t>(15, cfg.ema_shift);
+
+    if (m_filter.oversample > 1) {
+        m_oversampled.resize(m_filter.oversample * Driver::CHANNELS);
+    } else {
+        std::vector<uint16_t>().swap(m_oversampled);
+    }
+    resetFilter();
+}
+
+void LineSensor::resetFilter() {
+    m_filter_frames = 0;
+}
+
+esp_err_t LineSensor::filteredRead(uint16_t* dest) const {
+    const int count = getChannelsCount();
+    const int oversample = m_filter.oversample;
+
+    esp_err_t res;
+    const bool compensate = m_filter.ambient_compensation && !isSampling();
+    if (oversample > 1 && !isSampling()) {
+        if (compensate) {
+            res = ESP_OK;
+            for (int f = 0; f < oversample && res == ESP_OK; ++f) {
+                res = readAmbientCompensated(m_oversampled.data() + f * count);
+            }
+        } else {
+            res = readFrames(m_oversampled.data(), oversample);
+        }
+        if (res != ESP_OK)
+            return res;
+
+        for (int i = 0; i < count; ++i) {
+            uint32_t sum = oversample / 2;
+            for (int f = 0; f < oversample; ++f) {
+                sum += m_oversampled[f * count + i];
+            }
+            dest[i] = sum / oversample;
+        }
     } else {
-        val = int32_t(val - m_calibration.min[chan]) * MAX_VAL / m_calibration.range[chan];
-        return std::min(MAX_VAL, val);
+        res = compensate ? readAmbientCompensated(dest) : read(dest);
+        if (res != ESP_OK)
+            return res;
+    }
+
+    switch (m_filter.type) {
+    case FILTER_NONE:
+        break;
+    case FILTER_EMA:
+        for (int i = 0; i < count; ++i) {
+            const uint32_t val = uint32_t(dest[i]) << 8;
+            if (m_filter_frames == 0) {
+                m_ema[i] = val;
+            } else {
+                m_ema[i] = int32_t(m_ema[i]) + ((int32_t(val) - int32_t(m_ema[i])) >> m_filter.ema_shift);
+            }
+            dest[i] = (m_ema[i] + 128) >> 8;
+        }
+        break;
+    case FILTER_MEDIAN3:
+        for (int i = 0; i < count; ++i) {
+            const uint16_t val = dest[i];
+            if (m_filter_frames >= 2) {
+                const uint16_t a = m_history[0][i];
+                const uint16_t b = m_history[1][i];
+                dest[i] = std::max(std::min(a, b), std::min(std::max(a, b), val));
+            }
+            m_history[1][i] = m_history[0][i];
+            m_history[0][i] = val;
+        }
+        break;
     }
+
+    if (m_filter_frames < 2)
+        ++m_filter_frames;
+    return ESP_OK;
 }
 
 esp_err_t LineSensor::calibratedRead(std::vector<uint16_t>& results) const {
-    const auto res = read(results);
-    if (res == ESP_OK)
-        calibrateResults(results.data());
+    const size_t orig_size = results.size();
+    results.resize(orig_size + getChannelsCount());
+
+    const auto res = calibratedRead(results.data() + orig_size);
+    if (res != ESP_OK)
+        results.resize(orig_size);
     return res;
 }
 
 esp_err_t LineSensor::calibratedRead(uint16_t* dest) const {
-    const auto res = read(dest);
+    const auto res = filteredRead(dest);
     if (res == ESP_OK)
         calibrateResults(dest);
     return res;
 }
 
+esp_err_t LineSensor::calibratedRead(uint8_t mask, uint16_t* dest) const {
+    const auto res = read(mask, dest);
+    if (res != ESP_OK)
+        return res;
+
+    const TablesLock lock(*this);
+    for (; mask != 0; mask &= mask - 1) {
+        *dest = calibrateValue(*lock, __builtin_ctz(mask), *dest);
+        ++dest;
+    }
+    return ESP_OK;
+}
+
 uint16_t LineSensor::calibratedReadChannel(uint8_t channel, esp_err_t* result) const {
     auto val = readChannel(channel, false, result);
-    return calibrateValue(channel, val);
+    const TablesLock lock(*this);
+    return calibrateValue(*lock, channel, val);
 }
 
 LineSensorCalibrator::LineSensorCalibrator(LineSensor& sensor)
-    : m_sensor(sensor) {
+    : m_sensor(sensor)
+    , m_histogram(Driver::CHANNELS * BINS)
+    , m_reject_per_mille(20) {
     reset();
 }
 
@@ -138,7 +477,9 @@ void LineSensorCalibrator::reset() {
     for (int i = 0; i < Driver::CHANNELS; ++i) {
         m_data.min[i] = Driver::MAX_VAL;
         m_max[i] = 0;
+        m_count[i] = 0;
     }
+    std::fill(m_histogram.begin(), m_histogram.end(), 0);
 }
 
 esp_err_t LineSensorCalibrator::record() {
@@ -148,27 +489,69 @@ esp_err_t LineSensorCalibrator::record() {
         return res;
     }
 
-    int idx = 0;
-    const auto mask = m_sensor.getChannelsMask();
-    for (int i = 0; i < Driver::CHANNELS; ++i) {
-        if (((1 << i) & mask) == 0)
-            continue;
-
+    const int count = m_sensor.getChannelsCount();
+    for (int idx = 0; idx < count; ++idx) {
+        const int i = m_sensor.channelAt(idx);
         if (vals[idx] < m_data.min[i])
             m_data.min[i] = vals[idx];
         if (vals[idx] > m_max[i])
             m_max[i] = vals[idx];
-        ++idx;
+
+        uint16_t* bins = m_histogram.data() + i * BINS;
+        uint16_t& bin = bins[(vals[idx] & Driver::MAX_VAL) >> BIN_SHIFT];
+        if (bin == UINT16_MAX) {
+            // Halving all bins keeps the distribution, only the oldest values lose some weight
+            m_count[i] = 0;
+            for (int b = 0; b < BINS; ++b) {
+                bins[b] = (bins[b] + 1) / 2;
+                m_count[i] += bins[b];
+            }
+        }
+        ++bin;
+        ++m_count[i];
     }
 
     return ESP_OK;
 }
 
+uint16_t LineSensorCalibrator::percentileMin(int chan, uint32_t skip) const {
+    const uint16_t* bins = m_histogram.data() + chan * BINS;
+    uint32_t seen = 0;
+    for (int b = 0; b < BINS; ++b) {
+        seen += bins[b];
+        if (seen > skip)
+            return std::max<uint16_t>(m_data.min[chan], b << BIN_SHIFT);
+    }
+    return m_data.min[chan];
+}
+
+uint16_t LineSensorCalibrator::percentileMax(int chan, uint32_t skip) const {
+    const uint16_t* bins = m_histogram.data() + chan * BINS;
+    uint32_t seen = 0;
+    for (int b = BINS - 1; b >= 0; --b) {
+        seen += bins[b];
+        if (seen > skip)
+            return std::min<uint16_t>(m_max[chan], ((b + 1) << BIN_SHIFT) - 1);
+    }
+    return m_max[chan];
+}
+
 void LineSensorCalibrator::save() {
+    LineSensor::CalibrationData data;
     for (int i = 0; i < Driver::CHANNELS; ++i) {
-        m_data.range[i] = m_max[i] - m_data.min[i];
+        if (m_count[i] == 0) {
+            data.min[i] = 0;
+            data.range[i] = Driver::MAX_VAL;
+            continue;
+        }
+
+        const uint32_t skip = uint64_t(m_count[i]) * m_reject_per_mille / 1000;
+        const uint16_t min = percentileMin(i, skip);
+        const uint16_t max = std::max(min, percentileMax(i, skip));
+        data.min[i] = min;
+        data.range[i] = max - min;
     }
-    m_sensor.setCalibration(m_data);
+    m_sensor.setCalibration(data);
 }
 
 }; // namespace mcp3008
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <driver/spi_master.h>
 #include <vector>
 
 #include "mcp3008_driver.h"
+#include "mcp3008_line_analysis.h"
+#include "mcp3008_line_tracker.h"
+#include "mcp3008_telemetry.h"
 
 namespace mcp3008 {
 
@@ -28,9 +32,98 @@ public:
         uint16_t range[Driver::CHANNELS];
     } __attribute__((packed));
 
+    /**
+     * \brief How are the raw values converted to the calibrated ones.
+     */
+    enum CalibrationMode {
+        /**
+         * Multiply by a per-channel fixed-point reciprocal of the calibrated range
+         * precomputed in setCalibration(). Costs no extra memory.
+         */
+        CALIBRATION_RECIPROCAL,
+        /**
+         * Look the calibrated value up in a per-channel table precomputed in setCalibration().
+         * Fastest, but allocates (Driver::MAX_VAL + 1) * Driver::CHANNELS * 2 bytes (16 KB) on the heap,
+         * twice, because the calibration is double-buffered, see setCalibration().
+         */
+        CALIBRATION_LUT,
+    };
+
+    /**
+     * \brief Filter applied to the raw values before the calibration, see FilterConfig.
+     */
+    enum FilterType {
+        FILTER_NONE,
+        FILTER_EMA, //!< Exponential moving average, see FilterConfig::ema_shift.
+        FILTER_MEDIAN3, //!< Median of the last 3 frames, removes single-frame spikes.
+    };
+
+    /**
+     * \brief Configuration of the filtering stage, see setFilter().
+     */
+    struct FilterConfig {
+        FilterConfig(uint8_t oversample = 1, FilterType type = FILTER_NONE, uint8_t ema_shift = 2) {
+            this->oversample = oversample;
+            this->type = type;
+            this->ema_shift = ema_shift;
+
+            this->ambient_compensation = false;
+        }
+
+        uint8_t oversample; //!< Average this many frames read in one queued burst, see Driver::readFrames().
+        FilterType type; //!< Filter applied to the (averaged) frames.
+        uint8_t ema_shift; //!< FILTER_EMA weight of the new frame is 1/2^ema_shift.
+
+        /**
+         * \brief Subtract the ambient light from each frame, see Driver::readAmbientCompensated().
+         *
+         * Requires Config::pin_emitter. While sampling, use SamplerConfig::ambient_compensation
+         * instead, the sampled frames are used as they are.
+         */
+        bool ambient_compensation;
+    };
+
+    /**
+     * \brief Calibrated frame and line position computed by the sampling task, see readLatestLine().
+     */
+    struct LineFrame {
+        int64_t timestamp; //!< See Driver::Frame::timestamp.
+        uint16_t values[Driver::CHANNELS]; //!< Calibrated values, in the same format as calibratedRead().
+        int16_t line; //!< Line position, in the same format as readLineFixed().
+    };
+
     LineSensor();
     virtual ~LineSensor();
 
+    /**
+     * \brief Set the filtering stage between the chip and the calibration.
+     *
+     * The filter is used by calibratedRead(uint16_t*) const and everything based on it,
+     * including readLine(). The filter state is allocated here and reset,
+     * so the filtered reads do not allocate.
+     * Reads of only some channels, calibratedRead(uint8_t, uint16_t*) const,
+     * and the calibration itself are not filtered.
+     *
+     * While the sampling task is running (Driver::startSampling()), the oversampling
+     * is not done and every read is filtered as a new frame,
+     * even if the sampling task did not provide a new one yet.
+     */
+    void setFilter(const FilterConfig& cfg);
+
+    const FilterConfig& getFilter() const { return m_filter; } //!< Get the filter set by setFilter().
+
+    void resetFilter(); //!< Forget the filter's history, e.g. after the robot was moved.
+
+    /**
+     * \brief Set how the calibration is applied, default is CALIBRATION_RECIPROCAL.
+     *
+     * Both modes return exactly the same values, they differ only in speed and memory usage.
+     * Switching to CALIBRATION_LUT allocates the tables, switching back frees them.
+     */
+    void setCalibrationMode(CalibrationMode mode);
+
+    CalibrationMode getCalibrationMode() const { return activeTables().mode; } //!< Get the mode set by setCalibrationMode().
+
     /**
      * \brief Start the sensor line calibration procedure.
      *
@@ -44,16 +137,66 @@ public:
      *
      * \return CalibrationData reference
      */
-    const CalibrationData& getCalibration() const { return m_calibration; }
+    const CalibrationData& getCalibration() const { return activeTables().data; }
 
     /**
      * \brief Set calibration data used by the line sensor.
      *
+     * The new calibration is prepared aside and swapped in atomically, so a concurrent read,
+     * e.g. by the sampling task, uses either the old or the new calibration for the whole frame,
+     * never a mix of both. If a read still uses the calibration from before the previous call,
+     * this waits for it to finish, which takes at most one frame's calibration.
+     * This, setCalibrationMode() and loadCalibration() must be called from one task at a time.
+     *
      * \param data the calibration data obtained previously from getCalibration().
      * \return if the result is false, calibration data were invalid (out of range)
      */
     bool setCalibration(const CalibrationData& data);
 
+    /**
+     * \brief Load the calibration saved by saveCalibration() from NVS and set it.
+     *
+     * Only reads one small blob, so this is quick enough to be called at boot.
+     * The NVS flash must be initialized beforehand, e.g. by nvs_flash_init().
+     *
+     * \param key NVS key of the calibration, at most 15 characters.
+     * \param nvs_namespace NVS namespace of the calibration, at most 15 characters.
+     * \return ESP_OK, ESP_ERR_NVS_NOT_FOUND when nothing was saved yet, ESP_ERR_INVALID_VERSION
+     *         or ESP_ERR_INVALID_CRC for data saved by a different version or damaged,
+     *         ESP_ERR_INVALID_ARG if rejected by setCalibration() or any other NVS error code.
+     *         The calibration is unchanged unless ESP_OK is returned.
+     */
+    esp_err_t loadCalibration(const char* key = "calibration", const char* nvs_namespace = "mcp3008");
+
+    /**
+     * \brief Save the current calibration to NVS, with a version and a CRC.
+     *
+     * Blocks while the flash is written, which may take tens of milliseconds
+     * with the flash cache disabled, see saveCalibrationAsync().
+     *
+     * \param key see loadCalibration().
+     * \param nvs_namespace see loadCalibration().
+     * \return ESP_OK or any NVS error code.
+     */
+    esp_err_t saveCalibration(const char* key = "calibration", const char* nvs_namespace = "mcp3008") const;
+
+    /**
+     * \brief Same as saveCalibration(), but the flash is written by a new low priority task.
+     *
+     * The current calibration is copied before this method returns, the result
+     * can be checked later using isSavingCalibration() and getSaveResult().
+     *
+     * \param priority priority of the saving task.
+     * \param core the CPU core the saving task runs on, should not be the control loop's one.
+     * \return ESP_OK if the task was started, ESP_ERR_INVALID_STATE if the previous save
+     *         did not finish yet, ESP_ERR_INVALID_ARG for too long names or ESP_ERR_NO_MEM.
+     */
+    esp_err_t saveCalibrationAsync(const char* key = "calibration", const char* nvs_namespace = "mcp3008",
+        UBaseType_t priority = 1, BaseType_t core = tskNO_AFFINITY);
+
+    bool isSavingCalibration() const { return m_saving_calibration.load(); } //!< Is saveCalibrationAsync() still running?
+    esp_err_t getSaveResult() const { return m_save_result.load(); } //!< Result of the last finished saveCalibrationAsync().
+
     /**
      * \brief Try to determine a black line's position under the sensors.
      *
@@ -68,9 +211,143 @@ public:
      *              0.0: under channel 3-4 \n
      *              1.0: under channel 7 \n
      *         Returns NaN when the line is not found (see \p line_threshold).
+     *
+     * This method does not allocate any memory on the heap, it is safe to call
+     * it from a high-frequency control loop.
      */
     float readLine(bool white_line = false, float line_threshold = 0.20f) const;
 
+    /**
+     * \brief Compute the line's position from already read values, see readLine().
+     *
+     * Does not allocate any memory, which makes it usable on values
+     * obtained by calibratedRead(uint16_t*) into a caller-provided buffer.
+     *
+     * \param vals calibrated values, as returned by calibratedRead().
+     * \param count amount of values in the \p vals array.
+     * \param white_line see readLine()
+     * \param line_threshold see readLine()
+     * \return see readLine()
+     */
+    static float computeLine(const uint16_t* vals, size_t count, bool white_line = false, float line_threshold = 0.20f);
+
+    static constexpr int16_t LINE_MAX = 32767; //!< readLineFixed() value for the line under the channel with the greatest ID.
+    static constexpr int16_t LINE_NOT_FOUND = INT16_MIN; //!< readLineFixed() value when the line is not found.
+
+    /**
+     * \brief Integer-only variant of readLine(), which does not use the FPU at all.
+     *
+     * \param white_line see readLine()
+     * \param line_threshold values above this threshold will be considered "on the line",
+     *        in range <0; Driver::MAX_VAL>. The default is the same as readLine()'s 20%.
+     * \return Line position in range <-LINE_MAX; LINE_MAX>, which is readLine()'s <-1; 1> range
+     *         in the Q15 fixed-point format. Returns LINE_NOT_FOUND when the line is not found.
+     */
+    int16_t readLineFixed(bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5) const;
+
+    /**
+     * \brief Integer-only variant of computeLine(), see readLineFixed().
+     */
+    static int16_t computeLineFixed(const uint16_t* vals, size_t count, bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5);
+
+    /**
+     * \brief How readLine() and readLineFixed() compute the position, see setLineEstimator().
+     */
+    enum LineEstimator {
+        /**
+         * Centroid of all the channels, see computeLineFixed(). The default.
+         * Biased towards the middle when the background channels are not fully dark.
+         */
+        LINE_CENTROID,
+        /**
+         * Vertex of a parabola fitted through the strongest channel and its two neighbours.
+         * The background channels do not affect the position at all.
+         */
+        LINE_PARABOLIC,
+        /**
+         * Centroid of the strongest channel and its two neighbours only.
+         * Smoother than LINE_PARABOLIC for lines narrower than the channel spacing.
+         */
+        LINE_PEAK_CENTROID,
+    };
+
+    /**
+     * \brief Set the estimator used by readLine(), readLineFixed() and the sampling task.
+     *
+     * The position of each channel is precomputed at compile time for every channel count,
+     * so LINE_PARABOLIC and LINE_PEAK_CENTROID only do one division per frame.
+     * Missing neighbours of the edge channels are taken as the background.
+     */
+    void setLineEstimator(LineEstimator estimator) { m_line_estimator = estimator; }
+
+    LineEstimator getLineEstimator() const { return m_line_estimator; } //!< Get the estimator set by setLineEstimator().
+
+    /**
+     * \brief Read the lines under the sensors, with junctions and their positions.
+     *
+     * Replacement for readLineFixed() at about the same cost, which does not average
+     * several lines into one position, see LineAnalysis.
+     *
+     * \param result overwritten with the analysis of the frame.
+     * \param white_line see readLineFixed().
+     * \param line_threshold see readLineFixed().
+     * \return ESP_OK or any error code encountered during reading, \p result is unchanged on errors.
+     */
+    esp_err_t readLineAnalysis(LineAnalysis& result, bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5) const;
+
+    /**
+     * \brief Read the line's position using a tracker which keeps state between the calls.
+     *
+     * Cheaper than readLineFixed() while the line is being tracked, and reports on which side
+     * the line was lost instead of returning LINE_NOT_FOUND, see LineTracker.
+     * While tracking, only the channels in the tracker's window are read from the chip,
+     * which makes the frame several times shorter. All the channels are read
+     * when the tracker needs a full scan.
+     *
+     * \param tracker the tracker, use one per LineSensor.
+     * \return see LineTracker::update(). On read errors, the state is LineTracker::LINE_NEVER_SEEN
+     *         and the position LINE_NOT_FOUND, the tracker is left unchanged.
+     */
+    LineTracker::Result readLineTracked(LineTracker& tracker) const;
+
+    /**
+     * \brief Start the sampling task, which also calibrates each frame and computes
+     *        the line position, see Driver::startSampling() and readLatestLine().
+     *
+     * The calibration and the line position are computed once per frame in the sampling task,
+     * so any number of tasks can read them without a mutex and without repeating the work.
+     * The filter from setFilter() is not applied to these frames.
+     * setCalibration() and setCalibrationMode() can be called while sampling,
+     * each frame is calibrated either the old way or the new one.
+     *
+     * \param white_line see readLineFixed().
+     * \param line_threshold see readLineFixed().
+     */
+    esp_err_t startSampling(const SamplerConfig& cfg = SamplerConfig(), bool white_line = false,
+        uint16_t line_threshold = Driver::MAX_VAL / 5);
+
+    /**
+     * \brief Copy the newest calibrated frame and line position computed by the sampling task.
+     *
+     * Like Driver::readLatest(), this can be called from any number of tasks on either core
+     * at the same time, it does not block and never waits for the SPI bus.
+     *
+     * \return sequence number of the frame, see Driver::readLatest().
+     *         Returns 0 if the sampling is not running (\p frame is unchanged).
+     */
+    uint32_t readLatestLine(LineFrame& frame) const;
+
+    /**
+     * \brief Let the sampling task record each frame into \p ring, see TelemetryRecord.
+     *
+     * The sampling task is the producer, only one other task may consume the records.
+     * When the ring is full, the new records are dropped, the sampling never waits.
+     *
+     * \param ring the ring, which must outlive the sampling, or null to stop recording.
+     * \return ESP_OK, or ESP_ERR_INVALID_STATE while the sampling task is running.
+     */
+    esp_err_t setTelemetry(TelemetryRing* ring);
+
     /**
      * \brief Same as Driver::read(), but returns calibrated result if possible
      *
@@ -89,6 +366,11 @@ public:
      */
     esp_err_t calibratedRead(uint16_t* dest) const;
 
+    /**
+     * \brief Same as Driver::read(uint8_t, uint16_t*, bool) const, but returns calibrated results.
+     */
+    esp_err_t calibratedRead(uint8_t mask, uint16_t* dest) const;
+
     /**
      * \brief Same as Driver::readChannel(), but returns calibrated data.
      *
@@ -97,13 +379,114 @@ public:
      */
     uint16_t calibratedReadChannel(uint8_t channel, esp_err_t* result = nullptr) const;
 
+protected:
+    void onFrameSampled(const Frame& frame) override;
+
+    esp_err_t filteredRead(uint16_t* dest) const; //!< Driver::read() followed by the filter from setFilter()
+    int16_t estimateLine(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) const; //!< Line position using setLineEstimator()
+    void calibrateResults(uint16_t* dest) const;
+
+    /**
+     * \brief Calibration data with everything precomputed from it, see setCalibration().
+     */
+    struct CalibrationTables {
+        CalibrationData data;
+        CalibrationMode mode;
+        uint32_t gain[Driver::CHANNELS]; //!< MAX_VAL / range, with GAIN_SHIFT fraction bits, rounded up.
+        std::vector<uint16_t> lut; //!< Calibrated value of each raw value of each channel, in CALIBRATION_LUT mode only
+    };
+
+    /**
+     * \brief The calibration currently in use, see TablesLock. Only for reads of single fields
+     *        by the task which sets the calibration, everything else should hold a TablesLock.
+     */
+    const CalibrationTables& activeTables() const { return m_tables[m_active_tables.load(std::memory_order_acquire)]; }
+
+    /**
+     * \brief Holds the calibration currently in use, swapCalibration() does not rewrite it
+     *        until the lock is released. Hold one for the whole frame, so that the whole frame
+     *        is calibrated the same way.
+     */
+    class TablesLock {
+    public:
+        explicit TablesLock(const LineSensor& sensor) {
+            while (true) {
+                const uint8_t idx = sensor.m_active_tables.load();
+                m_readers = &sensor.m_table_readers[idx];
+                m_readers->fetch_add(1);
+                // Still active, so swapCalibration() either saw this reader, or it is not
+                // going to touch this slot before another swap.
+                if (sensor.m_active_tables.load() == idx) {
+                    m_tables = &sensor.m_tables[idx];
+                    return;
+                }
+                m_readers->fetch_sub(1, std::memory_order_release);
+            }
+        }
+        ~TablesLock() { m_readers->fetch_sub(1, std::memory_order_release); }
+
+        const CalibrationTables& operator*() const { return *m_tables; }
+        const CalibrationTables* operator->() const { return m_tables; }
+
+    private:
+        TablesLock(const TablesLock&) = delete;
+        TablesLock& operator=(const TablesLock&) = delete;
+
+        const CalibrationTables* m_tables;
+        std::atomic<uint32_t>* m_readers;
+    };
+
+    static uint16_t calibrateValue(const CalibrationTables& t, int chan, uint16_t val) {
+        if (t.mode == CALIBRATION_LUT)
+            return t.lut[chan * (MAX_VAL + 1) + (val & MAX_VAL)];
+        return calibrateReciprocal(t, chan, val);
+    }
+
+    static uint16_t calibrateReciprocal(const CalibrationTables& t, int chan, uint16_t val) {
+        if (val <= t.data.min[chan])
+            return 0;
+
+        // Exactly equal to (val - min) * MAX_VAL / range, because the reciprocal
+        // is rounded up and the 22 fraction bits are enough for 10-bit values.
+        const uint32_t diff = val - t.data.min[chan];
+        if (diff >= t.data.range[chan])
+            return MAX_VAL;
+        return (diff * t.gain[chan]) >> GAIN_SHIFT;
+    }
+
 private:
+    friend class LineSensorArray;
+    friend class LineSensorCalibrator;
+
     LineSensor(const LineSensor&) = delete;
 
-    void calibrateResults(uint16_t* dest) const;
-    inline uint16_t calibrateValue(int chan, uint16_t val) const;
+    static constexpr int GAIN_SHIFT = 22; //!< Fraction bits of m_gain, the most which fits 32-bit math for 10-bit values.
+
+    static void updateCalibrationTables(CalibrationTables& t);
+    void swapCalibration(const CalibrationData& data, CalibrationMode mode);
+
+    static void saveCalibrationTask(void* job);
+
+    int16_t estimatePeak(const uint16_t* vals, size_t count, bool white_line, uint16_t line_threshold) const;
+
+    CalibrationTables m_tables[2]; //!< The active one and the one swapCalibration() prepares
+    std::atomic<uint8_t> m_active_tables;
+    mutable std::atomic<uint32_t> m_table_readers[2]; //!< TablesLocks held on each of m_tables
+    std::atomic<bool> m_saving_calibration;
+    std::atomic<esp_err_t> m_save_result;
+
+    FilterConfig m_filter;
+    mutable std::vector<uint16_t> m_oversampled; //!< Buffer for m_filter.oversample frames
+    mutable uint32_t m_ema[Driver::CHANNELS]; //!< EMA state, with 8 fraction bits
+    mutable uint16_t m_history[2][Driver::CHANNELS]; //!< Last two frames for FILTER_MEDIAN3
+    mutable uint8_t m_filter_frames; //!< Frames seen by the filter since reset, saturated at 2
+
+    LineEstimator m_line_estimator;
 
-    CalibrationData m_calibration;
+    bool m_sampled_white_line; //!< startSampling() line parameters
+    uint16_t m_sampled_line_threshold;
+    SnapshotBuffer<LineFrame> m_latest_line;
+    TelemetryRing* m_telemetry;
 };
 
 /**
@@ -118,6 +501,11 @@ private:
  * This calibrator can be reused multiple times by calling
  * the reset() method between each session.
  *
+ * Each channel's values are counted in a fixed-size histogram,
+ * so that save() can ignore a small fraction of outliers (noise spikes)
+ * at both ends of the range, see setRejectFraction().
+ * record() only does a few increments per channel and never allocates.
+ *
  * Instances of this class are created via LineSensor's startCalibration().
  * It must not outlive the parent LineSensor object.
  */
@@ -138,14 +526,32 @@ public:
      */
     esp_err_t record();
 
+    /**
+     * \brief Set how many of the recorded values are ignored by save() as outliers.
+     *
+     * \param per_mille fraction of the values ignored at each end of the range, in 1/1000.
+     *        The default is 20, the 2nd and 98th percentiles are used as the minimum and maximum.
+     *        0 uses the raw minimum and maximum.
+     */
+    void setRejectFraction(uint16_t per_mille) { m_reject_per_mille = per_mille < 500 ? per_mille : 499; }
+
     void save(); //!< Store the calibrated values to the parent LineSensor.
 
 private:
+    static constexpr int BIN_SHIFT = 3; //!< Each histogram bin counts 2^BIN_SHIFT neighbouring values
+    static constexpr int BINS = (Driver::MAX_VAL >> BIN_SHIFT) + 1;
+
     LineSensorCalibrator(LineSensor& sensor);
 
+    uint16_t percentileMin(int chan, uint32_t skip) const;
+    uint16_t percentileMax(int chan, uint32_t skip) const;
+
     LineSensor& m_sensor;
     LineSensor::CalibrationData m_data;
     uint16_t m_max[Driver::CHANNELS];
+    uint32_t m_count[Driver::CHANNELS]; //!< Values in each channel's histogram
+    std::vector<uint16_t> m_histogram; //!< BINS counters per channel, halved when one would overflow
+    uint16_t m_reject_per_mille;
 };
 
 }; // namespace mcp3008
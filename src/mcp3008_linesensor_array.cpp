@@ -0,0 +1,143 @@
+#include <cmath>
+#include <esp_log.h>
+
+#include "mcp3008_linesensor_array.h"
+
+#define TAG "Mcp3008LineSensorArray"
+
+namespace mcp3008 {
+
+LineSensorArray::LineSensorArray() {
+}
+
+LineSensorArray::~LineSensorArray() {
+    uninstall();
+}
+
+esp_err_t LineSensorArray::install(const std::vector<Driver::Config>& chips) {
+    if (!m_chips.empty())
+        return ESP_OK;
+
+    // Each host initializes its bus with its own DMA channel, a shared one fails
+    // only on the second host's spi_bus_initialize() with a less obvious error.
+    int host_dma[VSPI_HOST + 1] = { -1, -1, -1 };
+    for (const auto& cfg : chips) {
+        if (cfg.spi_dev < SPI_HOST || cfg.spi_dev > VSPI_HOST || cfg.transport)
+            continue;
+        if (host_dma[cfg.spi_dev] < 0)
+            host_dma[cfg.spi_dev] = cfg.getDmaChannel();
+    }
+    for (int a = SPI_HOST; a <= VSPI_HOST; ++a) {
+        for (int b = a + 1; b <= VSPI_HOST; ++b) {
+            if (host_dma[a] > 0 && host_dma[a] == host_dma[b]) {
+                ESP_LOGE(TAG, "SPI hosts %d and %d both use DMA channel %d", a, b, host_dma[a]);
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+    }
+
+    size_t channels = 0;
+    for (const auto& cfg : chips) {
+        std::unique_ptr<LineSensor> chip(new LineSensor());
+        const esp_err_t res = chip->install(cfg);
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "failed to install chip %d: %d", int(m_chips.size()), res);
+            uninstall();
+            return res;
+        }
+
+        m_offsets.push_back(channels);
+        channels += chip->getChannelsCount();
+        m_chips.push_back(std::move(chip));
+    }
+
+    // Round-robin over the hosts, so that each of them starts transferring
+    // as soon as possible.
+    for (size_t round = 0; m_queue_order.size() < m_chips.size(); ++round) {
+        for (int host = SPI_HOST; host <= VSPI_HOST; ++host) {
+            size_t on_host = 0;
+            for (size_t i = 0; i < chips.size(); ++i) {
+                if (chips[i].spi_dev == host && on_host++ == round)
+                    m_queue_order.push_back(i);
+            }
+        }
+    }
+
+    for (bool polling : { true, false }) {
+        for (uint8_t idx : m_queue_order) {
+            if (chips[idx].polling == polling)
+                m_collect_order.push_back(idx);
+        }
+    }
+
+    m_scratch.resize(channels);
+    return ESP_OK;
+}
+
+esp_err_t LineSensorArray::uninstall() {
+    // Free the chips in the reverse order, so that the shared bus is freed last.
+    while (!m_chips.empty()) {
+        const esp_err_t res = m_chips.back()->uninstall();
+        if (res != ESP_OK)
+            return res;
+        m_chips.pop_back();
+    }
+    m_scratch.clear();
+    m_offsets.clear();
+    m_queue_order.clear();
+    m_collect_order.clear();
+    return ESP_OK;
+}
+
+esp_err_t LineSensorArray::read(uint16_t* dest, bool differential) const {
+    if (m_chips.empty())
+        return ESP_FAIL;
+
+    for (size_t i = 0; i < m_queue_order.size(); ++i) {
+        const esp_err_t res = m_chips[m_queue_order[i]]->queueFrame(differential, m_chips[m_queue_order[i]]->getChannelsMask());
+        if (res != ESP_OK) {
+            // Drain the chips which were queued successfully
+            for (size_t j = 0; j < i; ++j) {
+                m_chips[m_queue_order[j]]->collectFrame(m_scratch.data());
+            }
+            return res;
+        }
+    }
+
+    esp_err_t res = ESP_OK;
+    for (uint8_t idx : m_collect_order) {
+        const esp_err_t chip_res = m_chips[idx]->collectFrame(dest + m_offsets[idx]);
+        if (chip_res != ESP_OK && res == ESP_OK)
+            res = chip_res;
+    }
+    return res;
+}
+
+esp_err_t LineSensorArray::calibratedRead(uint16_t* dest) const {
+    const esp_err_t res = read(dest);
+    if (res != ESP_OK)
+        return res;
+
+    for (const auto& chip : m_chips) {
+        chip->calibrateResults(dest);
+        dest += chip->getChannelsCount();
+    }
+    return ESP_OK;
+}
+
+float LineSensorArray::readLine(bool white_line, float line_threshold) const {
+    const int16_t pos = readLineFixed(white_line, line_threshold * Driver::MAX_VAL);
+    return pos == LineSensor::LINE_NOT_FOUND ? nanf("") : float(pos) / LineSensor::LINE_MAX;
+}
+
+int16_t LineSensorArray::readLineFixed(bool white_line, uint16_t line_threshold) const {
+    const esp_err_t res = calibratedRead(m_scratch.data());
+    if (res != ESP_OK || m_scratch.empty()) {
+        ESP_LOGE(TAG, "read() failed: %d", res);
+        return LineSensor::LINE_NOT_FOUND;
+    }
+
+    return LineSensor::computeLineFixed(m_scratch.data(), m_scratch.size(), white_line, line_threshold);
+}
+
+}; // namespace mcp3008
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "mcp3008_linesensor.h"
+
+namespace mcp3008 {
+
+/**
+ * \brief Several MCP3008-based LineSensors acting as one wide sensor array.
+ *
+ * The chips can share one SPI bus, each with its own chip select pin,
+ * see Driver::Config::spi_dev. A read queues the conversions of all the chips first
+ * and only then waits for the results, so the chips do not block each other.
+ *
+ * The chips can also be spread over both HSPI_HOST and VSPI_HOST. The hosts
+ * then transfer at the same time, so a frame takes about as long as reading
+ * the chips of the busiest host only. The first chip of each host is queued first,
+ * and the chips in Driver::Config::polling mode are read while the queued ones
+ * are being transferred in the background. Each host needs its own DMA channel,
+ * which the default Driver::Config::dma_chan provides, or none (0).
+ *
+ * The channels are numbered in the order of the chips passed to install(),
+ * e.g. with two chips using all their channels, channels 0-7 are the first chip's
+ * and 8-15 are the second one's.
+ *
+ * Each chip is calibrated separately, through getChip(). Do not start
+ * the sampling task (Driver::startSampling()) on the individual chips.
+ *
+ * This class is not thread-safe, you have to make sure the methods are called
+ * from one thread at a time only.
+ */
+class LineSensorArray {
+public:
+    LineSensorArray();
+    ~LineSensorArray(); //!< The uninstall() method is called from the destructor.
+
+    /**
+     * \brief Initialize all the chips. Must be called before any other methods,
+     *        otherwise they will return ESP_FAIL.
+     *
+     * \param chips SPI configuration of each chip.
+     * \return ESP_OK or any error code encountered during the inialization.
+     *         ESP_ERR_INVALID_ARG if two hosts are set to the same DMA channel.
+     *         No chips are installed if an error is returned.
+     */
+    esp_err_t install(const std::vector<Driver::Config>& chips);
+
+    /**
+     * \brief Free all the chips.
+     *
+     * \return ESP_OK or any error code encountered during the freeing.
+     */
+    esp_err_t uninstall();
+
+    size_t getChipsCount() const { return m_chips.size(); } //!< Amount of chips passed to install().
+    LineSensor& getChip(size_t idx) { return *m_chips[idx]; } //!< Get one of the chips, e.g. to calibrate it.
+    const LineSensor& getChip(size_t idx) const { return *m_chips[idx]; } //!< Get one of the chips.
+
+    size_t getChannelsCount() const { return m_scratch.size(); } //!< Total amount of channels enabled on all the chips.
+
+    /**
+     * \brief Read values from all the chips, see Driver::read(uint16_t*, bool) const.
+     *
+     * \param dest array MUST be big enough to accomodate getChannelsCount() values!
+     */
+    esp_err_t read(uint16_t* dest, bool differential = false) const;
+
+    /**
+     * \brief Read calibrated values from all the chips, see LineSensor::calibratedRead(uint16_t*) const.
+     *
+     * \param dest array MUST be big enough to accomodate getChannelsCount() values!
+     */
+    esp_err_t calibratedRead(uint16_t* dest) const;
+
+    /**
+     * \brief Determine the line's position under all the chips' sensors, see LineSensor::readLine().
+     *
+     * -1 means the line is under the first channel of the first chip,
+     * 1 under the last channel of the last chip.
+     */
+    float readLine(bool white_line = false, float line_threshold = 0.20f) const;
+
+    /**
+     * \brief Integer-only variant of readLine(), see LineSensor::readLineFixed().
+     */
+    int16_t readLineFixed(bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5) const;
+
+private:
+    LineSensorArray(const LineSensorArray&) = delete;
+
+    std::vector<std::unique_ptr<LineSensor>> m_chips;
+    std::vector<size_t> m_offsets; //!< Index of each chip's first channel in the results
+    std::vector<uint8_t> m_queue_order; //!< Chips interleaved by SPI host
+    std::vector<uint8_t> m_collect_order; //!< Polling chips first, then m_queue_order
+    mutable std::vector<uint16_t> m_scratch;
+};
+
+}; // namespace mcp3008
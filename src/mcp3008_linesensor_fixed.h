@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cmath>
+#include <type_traits>
+#include <utility>
+
+#include "mcp3008_linesensor.h"
+
+namespace mcp3008 {
+
+/**
+ * \brief LineSensor with the channel mask fixed at compile time.
+ *
+ * The channel list, count and index mapping are constexpr, so the per-channel
+ * calibration in calibratedRead() is fully unrolled by the compiler and contains
+ * no mask checks. readLine() calibrates the same way, but the line estimate itself
+ * is the shared LineSensor code, which loops over the COUNT values at run time.
+ * Config::channels_mask passed to install() is ignored, \p Mask is used instead.
+ *
+ * \tparam Mask which channels to use, see Driver::Config::channels_mask.
+ */
+template <uint8_t Mask>
+class LineSensorT : public LineSensor {
+    static_assert(Mask != 0, "at least one channel has to be enabled");
+
+public:
+    static constexpr int COUNT = __builtin_popcount(Mask); //!< Amount of channels enabled in \p Mask.
+
+    /**
+     * \brief Get the chip channel of the idx-th result, compile-time version of requestToChannel().
+     */
+    static constexpr int channelAt(int idx) {
+        for (int chan = 0; chan < Driver::CHANNELS; ++chan) {
+            if ((Mask & (1 << chan)) != 0 && idx-- == 0)
+                return chan;
+        }
+        return -1;
+    }
+
+    /**
+     * \brief Get the index of \p chan in the results, inverse of channelAt().
+     */
+    static constexpr int indexOf(int chan) { return __builtin_popcount(Mask & ((1 << chan) - 1)); }
+
+    /**
+     * \brief See Driver::install(), Config::channels_mask is replaced by \p Mask.
+     */
+    esp_err_t install(Config cfg = Config()) {
+        cfg.channels_mask = Mask;
+        return LineSensor::install(cfg);
+    }
+
+    /**
+     * \brief See LineSensor::calibratedRead(uint16_t*) const.
+     *
+     * \param dest array of at least COUNT values.
+     * \return Will return ESP_ERR_INVALID_STATE if the sensor was installed with another
+     *         channel mask than \p Mask, e.g. through LineSensor::install().
+     */
+    esp_err_t calibratedRead(uint16_t* dest) const {
+        if (getChannelsMask() != Mask)
+            return ESP_ERR_INVALID_STATE;
+
+        const esp_err_t res = filteredRead(dest);
+        if (res == ESP_OK)
+            calibrateAll(*TablesLock(*this), dest, std::make_integer_sequence<int, COUNT>());
+        return res;
+    }
+
+    /**
+     * \brief See LineSensor::readLineFixed().
+     */
+    int16_t readLineFixed(bool white_line = false, uint16_t line_threshold = Driver::MAX_VAL / 5) const {
+        uint16_t vals[COUNT];
+        if (calibratedRead(vals) != ESP_OK)
+            return LINE_NOT_FOUND;
+        return estimateLine(vals, COUNT, white_line, line_threshold);
+    }
+
+    /**
+     * \brief See LineSensor::readLine().
+     */
+    float readLine(bool white_line = false, float line_threshold = 0.20f) const {
+        const int16_t pos = readLineFixed(white_line, line_threshold * MAX_VAL);
+        return pos == LINE_NOT_FOUND ? nanf("") : float(pos) / LINE_MAX;
+    }
+
+private:
+    template <int... Idx>
+    static void calibrateAll(const CalibrationTables& t, uint16_t* dest, std::integer_sequence<int, Idx...>) {
+        const int unused[] = { (dest[Idx] = calibrateValue(t, std::integral_constant<int, channelAt(Idx)>::value, dest[Idx]), 0)... };
+        (void)unused;
+    }
+};
+
+}; // namespace mcp3008
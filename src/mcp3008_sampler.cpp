@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <esp_log.h>
+
+#include "mcp3008_driver.h"
+
+#define TAG "Mcp3008Sampler"
+
+namespace mcp3008 {
+
+esp_err_t Driver::startSampling(const Driver::SamplerConfig& cfg) {
+    if (!m_installed || isSampling() || m_read_pending)
+        return ESP_FAIL;
+
+    const esp_err_t attached = ensureAttached();
+    if (attached != ESP_OK)
+        return attached;
+
+    // Publish the first frame from here, so that read() always has valid data
+    // once this method returns.
+    Frame frame;
+    frame.timestamp = esp_timer_get_time();
+    if (cfg.ambient_compensation && m_pin_emitter < 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    esp_err_t res = cfg.ambient_compensation
+        ? readAmbientBus(frame.values, cfg.differential, nullptr)
+        : readBus(frame.values, cfg.differential, m_channels_mask);
+    if (res != ESP_OK)
+        return res;
+    m_latest.publish(frame);
+    onFrameSampled(frame);
+
+    m_sampler_cfg = cfg;
+    m_sampler_stop.store(false);
+    m_sampler_reset_stats.store(true);
+
+    // Not the caller's task notification, it may be pending already or used for other things
+    m_sampler_done = xSemaphoreCreateBinary();
+    if (!m_sampler_done)
+        return ESP_ERR_NO_MEM;
+
+    TaskHandle_t task = nullptr;
+    if (xTaskCreatePinnedToCore(samplerTask, "mcp3008_sampler", cfg.stack_size, this, cfg.priority, &task, cfg.core) != pdPASS) {
+        ESP_LOGE(TAG, "failed to create the sampling task");
+        vSemaphoreDelete(m_sampler_done);
+        m_sampler_done = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+    m_sampler_task = task;
+
+    if (cfg.period_us != 0) {
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = samplerTimerCallback;
+        timer_args.arg = this;
+        timer_args.name = "mcp3008_sampler";
+
+        res = esp_timer_create(&timer_args, &m_sampler_timer);
+        if (res == ESP_OK) {
+            res = esp_timer_start_periodic(m_sampler_timer, cfg.period_us);
+        }
+
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "failed to start the sampling timer: %d", res);
+            stopSampling();
+            return res;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t Driver::stopSampling() {
+    if (!isSampling())
+        return ESP_FAIL;
+
+    // esp_timer_stop() does not wait for a callback which is already running,
+    // that one finds no task to notify then. The task itself runs until it is told to stop.
+    TaskHandle_t task = m_sampler_task.exchange(nullptr);
+    if (m_sampler_timer) {
+        esp_timer_stop(m_sampler_timer);
+        esp_timer_delete(m_sampler_timer);
+        m_sampler_timer = nullptr;
+    }
+
+    m_sampler_stop.store(true);
+    xTaskNotifyGive(task);
+    xSemaphoreTake(m_sampler_done, portMAX_DELAY);
+    vSemaphoreDelete(m_sampler_done);
+    m_sampler_done = nullptr;
+    return ESP_OK;
+}
+
+uint32_t Driver::readLatest(Frame& frame) const {
+    if (!isSampling())
+        return 0;
+    return m_latest.read(frame);
+}
+
+Driver::SamplingStats Driver::getSamplingStats() const {
+    SamplingStats stats = {};
+    m_sampler_stats.read(stats);
+    return stats;
+}
+
+void Driver::samplerTimerCallback(void* driver) {
+    auto* self = (Driver*)driver;
+    TaskHandle_t task = self->m_sampler_task.load();
+    if (task)
+        xTaskNotifyGive(task);
+}
+
+void Driver::samplerTask(void* driver) {
+    auto* self = (Driver*)driver;
+    const auto& cfg = self->m_sampler_cfg;
+
+    uint32_t expected_us = cfg.period_us;
+    if (expected_us == 0)
+        expected_us = cfg.period * portTICK_PERIOD_MS * 1000;
+
+    SamplingStats stats = {};
+    uint64_t period_sum = 0;
+    int64_t last_timestamp = 0;
+
+    Frame frame;
+    TickType_t last_wake = xTaskGetTickCount();
+    while (true) {
+        uint32_t periods = 1;
+        if (cfg.period_us != 0)
+            periods = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (self->m_sampler_stop.load())
+            break;
+
+        if (self->m_sampler_reset_stats.exchange(false)) {
+            stats = SamplingStats();
+            period_sum = 0;
+            last_timestamp = 0;
+        }
+
+        frame.timestamp = esp_timer_get_time();
+        const esp_err_t res = cfg.ambient_compensation
+            ? self->readAmbientBus(frame.values, cfg.differential, nullptr)
+            : self->readBus(frame.values, cfg.differential, self->m_channels_mask);
+        if (res == ESP_OK) {
+            self->m_latest.publish(frame);
+            self->onFrameSampled(frame);
+        } else {
+            ESP_LOGE(TAG, "read() failed: %d", res);
+        }
+
+        if (last_timestamp != 0) {
+            const uint32_t period = frame.timestamp - last_timestamp;
+            period_sum += period;
+            if (stats.frames == 1 || period < stats.period_min_us)
+                stats.period_min_us = period;
+            if (period > stats.period_max_us)
+                stats.period_max_us = period;
+            stats.period_mean_us = period_sum / stats.frames;
+
+            if (expected_us != 0) {
+                const uint32_t jitter = period > expected_us ? period - expected_us : expected_us - period;
+                stats.jitter_max_us = std::max(stats.jitter_max_us, jitter);
+            } else {
+                stats.jitter_max_us = stats.period_max_us - stats.period_min_us;
+            }
+        }
+        last_timestamp = frame.timestamp;
+        stats.missed += periods > 1 ? periods - 1 : 0;
+        ++stats.frames;
+        self->m_sampler_stats.publish(stats);
+
+        if (cfg.period_us == 0) {
+            if (cfg.period != 0) {
+                vTaskDelayUntil(&last_wake, cfg.period);
+            } else if (res != ESP_OK) {
+                vTaskDelay(1);
+            }
+        }
+    }
+
+    xSemaphoreGive(self->m_sampler_done);
+    vTaskDelete(nullptr);
+}
+
+}; // namespace mcp3008
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+namespace mcp3008 {
+
+/**
+ * \brief Lock-free double buffer holding the newest published value.
+ *
+ * There must be only one writer calling publish(), but any number of readers
+ * can call read() concurrently from any task or core.
+ * The writer never waits for the readers. A reader retries only if the writer
+ * has overwritten the slot it was copying from in the meantime, which can only
+ * happen if the copy took longer than two publish() periods.
+ */
+template <typename T>
+class SnapshotBuffer {
+public:
+    SnapshotBuffer()
+        : m_seq(0) {
+        m_slots[0].seq.store(0, std::memory_order_relaxed);
+        m_slots[1].seq.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Publish a new value. Must be called from one task only.
+     *
+     * \return sequence number of the published value, never 0.
+     */
+    uint32_t publish(const T& value) {
+        uint32_t seq = m_seq.load(std::memory_order_relaxed) + 1;
+        if (seq == 0)
+            seq = 1;
+
+        Slot& slot = m_slots[seq & 1];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.value = value;
+        slot.seq.store(seq, std::memory_order_release);
+
+        m_seq.store(seq, std::memory_order_release);
+        return seq;
+    }
+
+    /**
+     * \brief Copy the newest value to \p out.
+     *
+     * \return sequence number of the copied value, or 0 if nothing was published yet
+     *         (\p out is unchanged in that case).
+     */
+    uint32_t read(T& out) const {
+        while (true) {
+            const uint32_t seq = m_seq.load(std::memory_order_acquire);
+            if (seq == 0)
+                return 0;
+
+            const Slot& slot = m_slots[seq & 1];
+            const uint32_t before = slot.seq.load(std::memory_order_acquire);
+            if (before == 0)
+                continue;
+
+            out = slot.value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == before)
+                return before;
+        }
+    }
+
+    uint32_t sequence() const { return m_seq.load(std::memory_order_acquire); } //!< Sequence number of the newest value, 0 if none.
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq; //!< 0 while the slot is being written
+        T value;
+    };
+
+    Slot m_slots[2];
+    std::atomic<uint32_t> m_seq;
+};
+
+}; // namespace mcp3008
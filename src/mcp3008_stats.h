@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef MCP3008_STATS
+#include <xtensa/hal.h>
+
+#define MCP3008_STATS_START(name) const uint32_t name = xthal_get_ccount()
+#define MCP3008_STATS_RECORD(histogram, start) (histogram).record(xthal_get_ccount() - (start))
+#else
+#define MCP3008_STATS_START(name) \
+    do {                          \
+    } while (0)
+#define MCP3008_STATS_RECORD(histogram, start) \
+    do {                                       \
+    } while (0)
+#endif
+
+namespace mcp3008 {
+
+/**
+ * \brief Aggregated duration of one measured stage, in CPU cycles.
+ */
+struct TimingStats {
+    uint32_t count; //!< Amount of measurements.
+    uint32_t min;
+    uint32_t max;
+    uint32_t mean;
+    uint32_t p99; //!< 99th percentile, rounded up to the histogram's resolution (1/4 of an octave).
+};
+
+/**
+ * \brief Collects durations into a logarithmic histogram, see TimingStats.
+ *
+ * Each power of two is split into 4 buckets, values above 2^24 cycles
+ * (~70 ms at 240 MHz) all fall into the last one.
+ */
+class TimingHistogram {
+public:
+    TimingHistogram() { reset(); }
+
+    void reset() { memset(this, 0, sizeof(*this)); }
+
+    void record(uint32_t cycles) {
+        if (m_count == 0 || cycles < m_min)
+            m_min = cycles;
+        if (cycles > m_max)
+            m_max = cycles;
+        m_sum += cycles;
+        ++m_count;
+        ++m_buckets[bucketIndex(cycles)];
+    }
+
+    TimingStats get() const {
+        TimingStats stats = {};
+        if (m_count == 0)
+            return stats;
+
+        stats.count = m_count;
+        stats.min = m_min;
+        stats.max = m_max;
+        stats.mean = m_sum / m_count;
+
+        const uint32_t target = m_count - m_count / 100;
+        uint32_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += m_buckets[i];
+            if (seen >= target) {
+                stats.p99 = bucketMax(i) < m_max ? bucketMax(i) : m_max;
+                break;
+            }
+        }
+        return stats;
+    }
+
+private:
+    static constexpr int MAX_MSB = 24;
+    static constexpr int BUCKETS = 4 * MAX_MSB;
+
+    static int bucketIndex(uint32_t v) {
+        if (v < 4)
+            return v;
+        const int msb = 31 - __builtin_clz(v);
+        if (msb > MAX_MSB)
+            return BUCKETS - 1;
+        return 4 * (msb - 1) + ((v >> (msb - 2)) & 3);
+    }
+
+    static uint32_t bucketMax(int idx) {
+        if (idx < 4)
+            return idx;
+        const int msb = idx / 4 + 1;
+        const uint32_t lower = uint32_t(4 + idx % 4) << (msb - 2);
+        return lower + (uint32_t(1) << (msb - 2)) - 1;
+    }
+
+    uint64_t m_sum;
+    uint32_t m_count;
+    uint32_t m_min;
+    uint32_t m_max;
+    uint32_t m_buckets[BUCKETS];
+};
+
+}; // namespace mcp3008
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "mcp3008_driver.h"
+
+namespace mcp3008 {
+
+/**
+ * \brief Lock-free single-producer, single-consumer ring buffer.
+ *
+ * One task calls push(), another one calls pop() or drain(), no locks are needed.
+ * The memory is allocated by the constructor only, push() never blocks nor allocates,
+ * it drops the value when the buffer is full instead.
+ */
+template <typename T>
+class SpscRing {
+public:
+    /**
+     * \param capacity amount of values, rounded up to a power of two.
+     */
+    explicit SpscRing(size_t capacity)
+        : m_head(0)
+        , m_tail(0)
+        , m_dropped(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_buffer.resize(size);
+        m_mask = size - 1;
+    }
+
+    /**
+     * \brief Append a value. Must be called from the producer task only.
+     *
+     * \return false if the buffer was full and the value was dropped.
+     */
+    bool push(const T& value) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        m_buffer[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief Remove up to \p max oldest values and copy them to \p out.
+     *        Must be called from the consumer task only.
+     *
+     * \return amount of values copied.
+     */
+    size_t pop(T* out, size_t max) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t count = std::min(max, m_tail.load(std::memory_order_acquire) - head);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = m_buffer[(head + i) & m_mask];
+        }
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * \brief Pass all the buffered values to \p write in at most two contiguous batches,
+     *        without copying them. Must be called from the consumer task only.
+     *
+     * \param write called with the raw bytes of a batch of values, returns false on failure.
+     *        The values of a failed batch stay in the buffer.
+     * \param ctx passed to \p write.
+     * \return amount of values written.
+     */
+    size_t drain(bool (*write)(const void* data, size_t size, void* ctx), void* ctx) {
+        size_t written = 0;
+        for (int batch = 0; batch < 2; ++batch) {
+            const size_t head = m_head.load(std::memory_order_relaxed);
+            const size_t available = m_tail.load(std::memory_order_acquire) - head;
+            const size_t start = head & m_mask;
+            const size_t count = std::min(available, m_buffer.size() - start);
+            if (count == 0 || !write(&m_buffer[start], count * sizeof(T), ctx))
+                break;
+
+            m_head.store(head + count, std::memory_order_release);
+            written += count;
+        }
+        return written;
+    }
+
+    size_t size() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire); } //!< Amount of buffered values.
+    size_t capacity() const { return m_buffer.size(); } //!< Maximum amount of buffered values.
+    uint32_t dropped() const { return m_dropped.load(std::memory_order_relaxed); } //!< Values dropped by push() because the buffer was full.
+
+private:
+    SpscRing(const SpscRing&) = delete;
+
+    std::vector<T> m_buffer;
+    size_t m_mask;
+    std::atomic<size_t> m_head; //!< Next value to consume, only written by the consumer
+    std::atomic<size_t> m_tail; //!< Next slot to fill, only written by the producer
+    std::atomic<uint32_t> m_dropped;
+};
+
+/**
+ * \brief One sampled frame, as stored in a TelemetryRing by LineSensor::setTelemetry().
+ *
+ * The struct is packed into 42 bytes, so that batches from TelemetryRing::drain()
+ * can be sent as they are and parsed on the other side (all fields are little-endian).
+ */
+struct TelemetryRecord {
+    int64_t timestamp; //!< See Driver::Frame::timestamp.
+    uint16_t raw[Driver::CHANNELS]; //!< Values in the same format as Driver::read().
+    uint16_t calibrated[Driver::CHANNELS]; //!< Values in the same format as LineSensor::calibratedRead().
+    int16_t line; //!< Line position, in the same format as LineSensor::readLineFixed().
+} __attribute__((packed, aligned(2)));
+
+typedef SpscRing<TelemetryRecord> TelemetryRing;
+
+}; // namespace mcp3008
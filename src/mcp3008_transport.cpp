@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "mcp3008_driver.h"
+#include "mcp3008_transport.h"
+
+namespace mcp3008 {
+
+ReplayTransport::ReplayTransport(size_t queue_size)
+    : m_frame(0)
+    , m_served(0)
+    , m_conversions(0)
+    , m_queue(std::max<size_t>(1, queue_size))
+    , m_queue_head(0)
+    , m_queue_count(0) {
+}
+
+void ReplayTransport::setFrames(const uint16_t* frames, size_t count) {
+    m_frames.assign(frames, frames + count * CHANNELS);
+    m_conversions = 0;
+    rewind();
+}
+
+void ReplayTransport::rewind() {
+    m_frame = 0;
+    m_served = 0;
+}
+
+void ReplayTransport::convert(spi_transaction_t* trans) {
+    // Channel (or the differential pair code) from the request made by Driver::prepareTransaction(),
+    // in either of the framings, see Config::compact_framing.
+    const bool compact = trans->length == Driver::COMPACT_FRAME_BITS;
+    const int channel = compact ? (trans->tx_data[0] >> 3) & 0x07 : (trans->tx_data[1] >> 4) & 0x07;
+
+    if (m_served & (1 << channel)) {
+        m_served = 0;
+        if (++m_frame * CHANNELS >= m_frames.size())
+            m_frame = 0;
+    }
+    m_served |= 1 << channel;
+    ++m_conversions;
+
+    const uint16_t val = m_frames.empty() ? 0 : m_frames[m_frame * CHANNELS + channel];
+    if (compact) {
+        trans->rx_data[0] = (val >> 9) & 0x01;
+        trans->rx_data[1] = (val >> 1) & 0xFF;
+        trans->rx_data[2] = (val & 0x01) << 7;
+    } else {
+        trans->rx_data[0] = 0;
+        trans->rx_data[1] = (val >> 8) & 0x03;
+        trans->rx_data[2] = val & 0xFF;
+    }
+}
+
+esp_err_t ReplayTransport::queueTrans(spi_transaction_t* trans, TickType_t ticks_to_wait) {
+    if (m_queue_count == m_queue.size())
+        return ESP_ERR_TIMEOUT;
+
+    convert(trans);
+    m_queue[(m_queue_head + m_queue_count) % m_queue.size()] = trans;
+    ++m_queue_count;
+    return ESP_OK;
+}
+
+esp_err_t ReplayTransport::getTransResult(spi_transaction_t** trans, TickType_t ticks_to_wait) {
+    if (m_queue_count == 0)
+        return ESP_ERR_TIMEOUT;
+
+    *trans = m_queue[m_queue_head];
+    m_queue_head = (m_queue_head + 1) % m_queue.size();
+    --m_queue_count;
+    return ESP_OK;
+}
+
+esp_err_t ReplayTransport::transmit(spi_transaction_t* trans) {
+    convert(trans);
+    return ESP_OK;
+}
+
+}; // namespace mcp3008
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <driver/spi_master.h>
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace mcp3008 {
+
+/**
+ * \brief The SPI device operations used by the Driver, see Driver::Config::transport.
+ *
+ * The methods have the same semantics as the spi_device_* functions of the same name.
+ * The default SpiTransport forwards them to the SPI master driver, ReplayTransport
+ * answers the conversions from recorded frames instead, without any hardware.
+ */
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    virtual esp_err_t queueTrans(spi_transaction_t* trans, TickType_t ticks_to_wait) = 0;
+    virtual esp_err_t getTransResult(spi_transaction_t** trans, TickType_t ticks_to_wait) = 0;
+    virtual esp_err_t transmit(spi_transaction_t* trans) = 0;
+    virtual esp_err_t pollingTransmit(spi_transaction_t* trans) = 0;
+    virtual esp_err_t acquireBus(TickType_t wait) = 0;
+    virtual void releaseBus() = 0;
+};
+
+/**
+ * \brief Transport over an SPI master device, used by Driver::install() by default.
+ */
+class SpiTransport : public Transport {
+public:
+    SpiTransport()
+        : m_spi(nullptr) {}
+
+    void setDevice(spi_device_handle_t spi) { m_spi = spi; }
+
+    esp_err_t queueTrans(spi_transaction_t* trans, TickType_t ticks_to_wait) override { return spi_device_queue_trans(m_spi, trans, ticks_to_wait); }
+    esp_err_t getTransResult(spi_transaction_t** trans, TickType_t ticks_to_wait) override { return spi_device_get_trans_result(m_spi, trans, ticks_to_wait); }
+    esp_err_t transmit(spi_transaction_t* trans) override { return spi_device_transmit(m_spi, trans); }
+    esp_err_t pollingTransmit(spi_transaction_t* trans) override { return spi_device_polling_transmit(m_spi, trans); }
+    esp_err_t acquireBus(TickType_t wait) override { return spi_device_acquire_bus(m_spi, wait); }
+    void releaseBus() override { spi_device_release_bus(m_spi); }
+
+private:
+    spi_device_handle_t m_spi;
+};
+
+/**
+ * \brief Transport which replays recorded frames, for running the library without the chip.
+ *
+ * Each conversion request is answered immediately with the value of the requested channel
+ * from the current frame. The replay moves to the next frame once a channel is requested
+ * for the second time, so every read() of any channel mask gets values from one frame.
+ * After the last frame, the replay starts over from the first one.
+ *
+ * Does not use the SPI peripheral, so together with the ESP-IDF shim in test/host,
+ * the whole library runs in a desktop build, see test/host/CMakeLists.txt.
+ * test/host/bench_replay measures the frames per second of the line position
+ * path this way, without the SPI transfers.
+ * Not thread-safe, like the Driver itself.
+ */
+class ReplayTransport : public Transport {
+public:
+    static constexpr int CHANNELS = 8; //!< Same as Driver::CHANNELS.
+
+    /**
+     * \param queue_size how many transactions can be queued, should be at least Config::queue_size.
+     */
+    explicit ReplayTransport(size_t queue_size = 64);
+
+    /**
+     * \brief Set the frames to replay, restarts the replay.
+     *
+     * \param frames CHANNELS values for each frame, indexed by the chip's channel,
+     *        in range <0; Driver::MAX_VAL>.
+     * \param count amount of frames.
+     */
+    void setFrames(const uint16_t* frames, size_t count);
+
+    void rewind(); //!< Start the replay from the first frame again.
+
+    size_t getFrameIndex() const { return m_frame; } //!< Index of the frame answering the conversions now.
+    uint64_t getConversions() const { return m_conversions; } //!< Amount of conversions answered since setFrames().
+
+    esp_err_t queueTrans(spi_transaction_t* trans, TickType_t ticks_to_wait) override;
+    esp_err_t getTransResult(spi_transaction_t** trans, TickType_t ticks_to_wait) override;
+    esp_err_t transmit(spi_transaction_t* trans) override;
+    esp_err_t pollingTransmit(spi_transaction_t* trans) override { return transmit(trans); }
+    esp_err_t acquireBus(TickType_t wait) override { return ESP_OK; }
+    void releaseBus() override {}
+
+private:
+    void convert(spi_transaction_t* trans);
+
+    std::vector<uint16_t> m_frames;
+    size_t m_frame;
+    uint8_t m_served; //!< Channels already answered from the current frame
+    uint64_t m_conversions;
+
+    std::vector<spi_transaction_t*> m_queue; //!< Ring of the queued transactions
+    size_t m_queue_head;
+    size_t m_queue_count;
+};
+
+}; // namespace mcp3008
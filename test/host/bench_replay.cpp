@@ -0,0 +1,63 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "mcp3008_linesensor.h"
+#include "mcp3008_transport.h"
+
+// Desktop counterpart of examples/bench: frames per second of LineSensor::readLineFixed()
+// fed by ReplayTransport, i.e. the cost of the library itself without the SPI transfers.
+//   bench_replay [frames]
+
+using namespace mcp3008;
+
+static const char* modeName(const Driver::Config& cfg) {
+    return cfg.polling ? "polling" : "queued";
+}
+
+int main(int argc, char** argv) {
+    const long frames = argc > 1 ? atol(argv[1]) : 1000000;
+
+    // A line sweeping over the sensors
+    static constexpr int RECORDED = 64;
+    std::vector<uint16_t> recorded(RECORDED * Driver::CHANNELS);
+    for (int f = 0; f < RECORDED; ++f) {
+        for (int i = 0; i < Driver::CHANNELS; ++i) {
+            const int dist = abs(i * RECORDED / Driver::CHANNELS - f);
+            recorded[f * Driver::CHANNELS + i] = dist < 16 ? 900 - dist * 50 : 100;
+        }
+    }
+
+    printf("mode,frames,frames_per_sec,queue_p99,wait_p99,calibration_p99,line_p99\n");
+    for (bool polling : { false, true }) {
+        ReplayTransport replay;
+        replay.setFrames(recorded.data(), RECORDED);
+
+        LineSensor ls;
+        Driver::Config cfg;
+        cfg.transport = &replay;
+        cfg.polling = polling;
+        if (ls.install(cfg) != ESP_OK) {
+            printf("ERROR,install,%s\n", modeName(cfg));
+            return 1;
+        }
+
+        long found = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < frames; ++i)
+            found += ls.readLineFixed() != LineSensor::LINE_NOT_FOUND;
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (found != frames) {
+            printf("ERROR,line,%s,%ld\n", modeName(cfg), frames - found);
+            return 1;
+        }
+
+        // The shim counts nanoseconds instead of CPU cycles
+        const auto stats = ls.getStats();
+        printf("%s,%ld,%.0f,%u,%u,%u,%u\n", modeName(cfg), frames, frames / secs,
+            stats.queue.p99, stats.wait.p99, stats.calibration.p99, stats.line.p99);
+    }
+    return 0;
+}
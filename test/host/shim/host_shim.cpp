@@ -0,0 +1,482 @@
+#include <assert.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <driver/gpio.h>
+#include <driver/spi_master.h>
+#include <esp32/rom/crc.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <nvs.h>
+#include <soc/gpio_struct.h>
+#include <xtensa/hal.h>
+
+#include "host_shim.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const Clock::time_point s_start = Clock::now();
+
+/* FreeRTOS */
+
+struct tskTaskControlBlock {
+    std::mutex mutex;
+    std::condition_variable cond;
+    uint32_t notified = 0;
+};
+
+// The tasks are only freed at exit, the handles of finished tasks must stay valid
+// for the notifications racing with their end, and the tests create just a few.
+static std::mutex s_tasks_mutex;
+static std::vector<std::unique_ptr<tskTaskControlBlock>> s_tasks;
+static thread_local TaskHandle_t s_current_task = nullptr;
+
+static TaskHandle_t newTask() {
+    std::lock_guard<std::mutex> lock(s_tasks_mutex);
+    s_tasks.emplace_back(new tskTaskControlBlock());
+    return s_tasks.back().get();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char*, uint32_t, void* arg, UBaseType_t, TaskHandle_t* created_task, BaseType_t) {
+    TaskHandle_t task = newTask();
+    if (created_task)
+        *created_task = task;
+
+    std::thread([=]() {
+        s_current_task = task;
+        code(arg);
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    // Only the tasks deleting themselves as their last statement are supported,
+    // the thread ends by returning from the task function.
+    (void)task;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+void vTaskDelayUntil(TickType_t* previous_wake, TickType_t increment) {
+    *previous_wake += increment;
+    std::this_thread::sleep_until(s_start + std::chrono::milliseconds(*previous_wake * portTICK_PERIOD_MS));
+}
+
+TickType_t xTaskGetTickCount() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - s_start).count() / portTICK_PERIOD_MS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    if (!s_current_task)
+        s_current_task = newTask();
+    return s_current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    // configASSERT() in FreeRTOS
+    assert(task);
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        ++task->notified;
+    }
+    task->cond.notify_all();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto notified = [task]() { return task->notified != 0; };
+    if (ticks_to_wait == portMAX_DELAY) {
+        task->cond.wait(lock, notified);
+    } else if (!task->cond.wait_for(lock, std::chrono::milliseconds(ticks_to_wait * portTICK_PERIOD_MS), notified)) {
+        return 0;
+    }
+
+    const uint32_t value = task->notified;
+    task->notified = clear_on_exit ? 0 : value - 1;
+    return value;
+}
+
+struct QueueDefinition {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool given = false;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return new QueueDefinition();
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    delete semaphore;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    std::lock_guard<std::mutex> lock(semaphore->mutex);
+    if (semaphore->given)
+        return pdFAIL;
+    semaphore->given = true;
+    // Notified under the lock, the taker may delete the semaphore right after it wakes up
+    semaphore->cond.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    std::unique_lock<std::mutex> lock(semaphore->mutex);
+    auto given = [semaphore]() { return semaphore->given; };
+    if (ticks_to_wait == portMAX_DELAY) {
+        semaphore->cond.wait(lock, given);
+    } else if (!semaphore->cond.wait_for(lock, std::chrono::milliseconds(ticks_to_wait * portTICK_PERIOD_MS), given)) {
+        return pdFAIL;
+    }
+    semaphore->given = false;
+    return pdPASS;
+}
+
+/* esp_timer */
+
+// Like in ESP-IDF, esp_timer_stop() and esp_timer_delete() do not wait for a callback
+// which is already running. Its thread keeps the state alive until the callback returns.
+struct esp_timer_state {
+    esp_timer_create_args_t args;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool running = false;
+    uint32_t generation = 0; //!< Incremented by each start, so a stopped thread never resumes
+};
+
+struct esp_timer {
+    std::shared_ptr<esp_timer_state> state;
+};
+
+int64_t esp_timer_get_time() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - s_start).count();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    if (!create_args || !create_args->callback || !out_handle)
+        return ESP_ERR_INVALID_ARG;
+    *out_handle = new esp_timer();
+    (*out_handle)->state = std::make_shared<esp_timer_state>();
+    (*out_handle)->state->args = *create_args;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    std::shared_ptr<esp_timer_state> state = timer->state;
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (state->running)
+        return ESP_ERR_INVALID_STATE;
+
+    state->running = true;
+    const uint32_t generation = ++state->generation;
+    std::thread([state, period, generation]() {
+        auto next = Clock::now();
+        auto stopped = [&]() { return !state->running || state->generation != generation; };
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (true) {
+            next += std::chrono::microseconds(period);
+            if (state->cond.wait_until(lock, next, stopped))
+                break;
+            lock.unlock();
+            state->args.callback(state->args.arg);
+            lock.lock();
+        }
+    }).detach();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    {
+        std::lock_guard<std::mutex> lock(timer->state->mutex);
+        if (!timer->state->running)
+            return ESP_ERR_INVALID_STATE;
+        timer->state->running = false;
+    }
+    timer->state->cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    {
+        std::lock_guard<std::mutex> lock(timer->state->mutex);
+        if (timer->state->running)
+            return ESP_ERR_INVALID_STATE;
+    }
+    delete timer;
+    return ESP_OK;
+}
+
+uint32_t xthal_get_ccount() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - s_start).count();
+}
+
+/* GPIO */
+
+static int s_gpio_levels[GPIO_NUM_MAX];
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t) {
+    return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    s_gpio_levels[gpio_num] = level ? 1 : 0;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+    return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX ? s_gpio_levels[gpio_num] : 0;
+}
+
+gpio_dev_t GPIO = {
+    gpio_w1_reg_t(0, true),
+    gpio_w1_reg_t(0, false),
+    { gpio_w1_reg_t(32, true) },
+    { gpio_w1_reg_t(32, false) },
+};
+
+gpio_w1_reg_t& gpio_w1_reg_t::operator=(uint32_t mask) {
+    for (int bit = 0; bit < 32 && m_first_pin + bit < GPIO_NUM_MAX; ++bit) {
+        if (mask & (uint32_t(1) << bit))
+            s_gpio_levels[m_first_pin + bit] = m_set ? 1 : 0;
+    }
+    return *this;
+}
+
+/* SPI master */
+
+static constexpr int SPI_HOSTS = VSPI_HOST + 1;
+static constexpr int DMA_CHANNELS = 3;
+static constexpr int DEVICES_PER_HOST = 3;
+
+struct spi_device_t {
+    spi_host_device_t host;
+    spi_device_interface_config_t cfg;
+    std::deque<spi_transaction_t*> done;
+};
+
+static struct {
+    bool claimed[SPI_HOSTS]; //!< By something else than the master driver
+    bool initialized[SPI_HOSTS];
+    int host_dma[SPI_HOSTS];
+    bool dma_used[DMA_CHANNELS];
+    int devices[SPI_HOSTS];
+    host_shim::SpiResponder responder;
+    void* responder_arg;
+} s_spi;
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus_config, int dma_chan) {
+    if (host < 0 || host >= SPI_HOSTS || !bus_config || dma_chan < 0 || dma_chan >= DMA_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+    if (s_spi.claimed[host] || s_spi.initialized[host])
+        return ESP_ERR_INVALID_STATE; // "host already in use"
+    if (dma_chan != 0 && s_spi.dma_used[dma_chan])
+        return ESP_ERR_INVALID_STATE; // "dma channel already in use"
+
+    s_spi.initialized[host] = true;
+    s_spi.host_dma[host] = dma_chan;
+    if (dma_chan != 0)
+        s_spi.dma_used[dma_chan] = true;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host) {
+    if (host < 0 || host >= SPI_HOSTS)
+        return ESP_ERR_INVALID_ARG;
+    if (!s_spi.initialized[host] || s_spi.devices[host] != 0)
+        return ESP_ERR_INVALID_STATE;
+
+    s_spi.initialized[host] = false;
+    if (s_spi.host_dma[host] != 0)
+        s_spi.dma_used[s_spi.host_dma[host]] = false;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* handle) {
+    if (host < 0 || host >= SPI_HOSTS || !dev_config || !handle)
+        return ESP_ERR_INVALID_ARG;
+    if (!s_spi.initialized[host])
+        return ESP_ERR_INVALID_STATE; // "host not initialized"
+    if (s_spi.devices[host] == DEVICES_PER_HOST)
+        return ESP_ERR_NOT_FOUND; // "no free cs pins for the host"
+
+    ++s_spi.devices[host];
+    *handle = new spi_device_t();
+    (*handle)->host = host;
+    (*handle)->cfg = *dev_config;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle) {
+    if (!handle)
+        return ESP_ERR_INVALID_ARG;
+    if (!handle->done.empty())
+        return ESP_ERR_INVALID_STATE; // "have unfinished transactions"
+
+    --s_spi.devices[handle->host];
+    delete handle;
+    return ESP_OK;
+}
+
+static esp_err_t respond(spi_device_handle_t handle, spi_transaction_t* trans) {
+    if (!s_spi.responder)
+        return ESP_ERR_NOT_SUPPORTED;
+    if (handle->cfg.pre_cb)
+        handle->cfg.pre_cb(trans);
+    return s_spi.responder(handle->host, handle->cfg.clock_speed_hz, trans, s_spi.responder_arg);
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t* trans_desc, TickType_t) {
+    if (!handle || !trans_desc)
+        return ESP_ERR_INVALID_ARG;
+    if (int(handle->done.size()) >= handle->cfg.queue_size)
+        return ESP_ERR_TIMEOUT;
+
+    const esp_err_t res = respond(handle, trans_desc);
+    if (res != ESP_OK)
+        return res;
+    handle->done.push_back(trans_desc);
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t** trans_desc, TickType_t) {
+    if (!handle || !trans_desc)
+        return ESP_ERR_INVALID_ARG;
+    if (handle->done.empty())
+        return ESP_ERR_TIMEOUT;
+
+    *trans_desc = handle->done.front();
+    handle->done.pop_front();
+    return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc) {
+    if (!handle || !trans_desc)
+        return ESP_ERR_INVALID_ARG;
+    return respond(handle, trans_desc);
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc) {
+    return spi_device_transmit(handle, trans_desc);
+}
+
+esp_err_t spi_device_acquire_bus(spi_device_handle_t device, TickType_t) {
+    return device ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void spi_device_release_bus(spi_device_handle_t) {
+}
+
+/* NVS */
+
+static std::mutex s_nvs_mutex;
+static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> s_nvs;
+static std::vector<std::string> s_nvs_handles; //!< Namespace of each handle, by handle - 1
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    if (open_mode == NVS_READONLY && s_nvs.find(name) == s_nvs.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    s_nvs[name];
+    s_nvs_handles.push_back(name);
+    *out_handle = s_nvs_handles.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    const uint8_t* bytes = (const uint8_t*)value;
+    s_nvs[s_nvs_handles.at(handle - 1)][key].assign(bytes, bytes + length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    const auto& keys = s_nvs[s_nvs_handles.at(handle - 1)];
+    const auto itr = keys.find(key);
+    if (itr == keys.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+
+    if (out_value) {
+        if (*length < itr->second.size())
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(out_value, itr->second.data(), itr->second.size());
+    }
+    *length = itr->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t) {
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t) {
+}
+
+/* ROM */
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/* Controls */
+
+namespace host_shim {
+
+void setSpiResponder(SpiResponder responder, void* arg) {
+    s_spi.responder = responder;
+    s_spi.responder_arg = arg;
+}
+
+int getSpiDeviceCount(spi_host_device_t host) {
+    return s_spi.devices[host];
+}
+
+bool isSpiBusInitialized(spi_host_device_t host) {
+    return s_spi.initialized[host];
+}
+
+void claimSpiHost(spi_host_device_t host, bool claim) {
+    s_spi.claimed[host] = claim;
+}
+
+void claimDmaChannel(int dma_chan, bool claim) {
+    s_spi.dma_used[dma_chan] = claim;
+}
+
+void resetNvs() {
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    s_nvs.clear();
+}
+
+bool corruptNvsBlob(const char* name, const char* key, size_t offset) {
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    auto& blob = s_nvs[name][key];
+    if (offset >= blob.size())
+        return false;
+    blob[offset] ^= 1;
+    return true;
+}
+
+}; // namespace host_shim
@@ -0,0 +1,7 @@
+#pragma once
+
+// Host build shim of ESP-IDF.
+
+#include <stdint.h>
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
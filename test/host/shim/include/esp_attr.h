@@ -0,0 +1,6 @@
+#pragma once
+
+// Host build shim of ESP-IDF, everything runs from RAM.
+
+#define IRAM_ATTR
+#define DRAM_ATTR
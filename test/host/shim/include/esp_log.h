@@ -0,0 +1,22 @@
+#pragma once
+
+// Host build shim of ESP-IDF, the errors and warnings go to stderr,
+// the rest only with the MCP3008_HOST_VERBOSE environment variable set.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MCP3008_HOST_LOG(letter, tag, format, ...) fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) MCP3008_HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) MCP3008_HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                           \
+    do {                                                     \
+        if (getenv("MCP3008_HOST_VERBOSE"))                  \
+            MCP3008_HOST_LOG("I", tag, format, ##__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGD(tag, format, ...)                           \
+    do {                                                     \
+        if (getenv("MCP3008_HOST_VERBOSE"))                  \
+            MCP3008_HOST_LOG("D", tag, format, ##__VA_ARGS__); \
+    } while (0)
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <driver/gpio.h>
+#include <driver/spi_master.h>
+#include <stddef.h>
+
+/**
+ * \brief Controls of the host build shim of ESP-IDF, for the tests.
+ *
+ * The shim implements just enough of ESP-IDF and FreeRTOS to run the library
+ * on a desktop: FreeRTOS tasks are std::threads, esp_timer runs on threads too,
+ * NVS is kept in memory and the SPI master driver does the bus and device
+ * bookkeeping of the real one, with the transactions answered by a responder.
+ */
+namespace host_shim {
+
+/**
+ * \brief Answers one SPI transaction instead of the chip, called after the device's pre_cb.
+ *
+ * \return ESP_OK or the error the transaction fails with.
+ */
+typedef esp_err_t (*SpiResponder)(spi_host_device_t host, int clock_speed_hz, spi_transaction_t* trans, void* arg);
+
+/**
+ * \brief Set how the SPI transactions are answered, nullptr (the default) makes all of them
+ *        fail with ESP_ERR_NOT_SUPPORTED.
+ */
+void setSpiResponder(SpiResponder responder, void* arg = nullptr);
+
+int getSpiDeviceCount(spi_host_device_t host); //!< Devices currently added to \p host
+bool isSpiBusInitialized(spi_host_device_t host); //!< Was spi_bus_initialize() called for \p host and not freed?
+
+/**
+ * \brief Claim \p host for something else than the SPI master, e.g. the SPI slave driver,
+ *        so that spi_bus_initialize() fails on it. Pass false to release it again.
+ */
+void claimSpiHost(spi_host_device_t host, bool claim = true);
+
+/**
+ * \brief Mark \p dma_chan as used by another peripheral, so that spi_bus_initialize() fails with it.
+ */
+void claimDmaChannel(int dma_chan, bool claim = true);
+
+void resetNvs(); //!< Erase all the in-memory NVS namespaces.
+
+/**
+ * \brief Flip one bit of a stored NVS blob.
+ *
+ * \return false if there is no such blob, or it is too short.
+ */
+bool corruptNvsBlob(const char* name, const char* key, size_t offset);
+
+}; // namespace host_shim
@@ -0,0 +1,36 @@
+#pragma once
+
+// Host build shim of ESP-IDF. Only the output set/clear registers, writing them
+// changes the levels returned by gpio_get_level(), like on the chip.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+
+class gpio_w1_reg_t {
+public:
+    gpio_w1_reg_t(int first_pin, bool set)
+        : m_first_pin(first_pin)
+        , m_set(set) {}
+
+    gpio_w1_reg_t& operator=(uint32_t mask);
+
+private:
+    int m_first_pin;
+    bool m_set;
+};
+
+typedef struct {
+    gpio_w1_reg_t out_w1ts;
+    gpio_w1_reg_t out_w1tc;
+    struct {
+        gpio_w1_reg_t val;
+    } out1_w1ts;
+    struct {
+        gpio_w1_reg_t val;
+    } out1_w1tc;
+} gpio_dev_t;
+
+extern gpio_dev_t GPIO;
+
+#endif
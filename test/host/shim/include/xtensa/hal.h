@@ -0,0 +1,7 @@
+#pragma once
+
+// Host build shim of ESP-IDF, counts nanoseconds instead of CPU cycles.
+
+#include <stdint.h>
+
+uint32_t xthal_get_ccount();
@@ -0,0 +1,143 @@
+#include <atomic>
+#include <freertos/task.h>
+#include <host_shim.h>
+#include <thread>
+#include <vector>
+
+#include "mcp3008_linesensor.h"
+#include "mcp3008_transport.h"
+#include "test_util.h"
+
+using namespace mcp3008;
+
+static constexpr uint16_t RAW = 500;
+
+static LineSensor::CalibrationData makeCalibration(uint16_t min, uint16_t range) {
+    LineSensor::CalibrationData data;
+    for (int i = 0; i < Driver::CHANNELS; ++i) {
+        data.min[i] = min;
+        data.range[i] = range;
+    }
+    return data;
+}
+
+static void testSwapWhileSampling() {
+    std::vector<uint16_t> frames(Driver::CHANNELS, RAW);
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), 1);
+
+    LineSensor ls;
+    Driver::Config cfg;
+    cfg.transport = &replay;
+    CHECK_EQ(ls.install(cfg), ESP_OK);
+
+    const auto first = makeCalibration(0, Driver::MAX_VAL);
+    const auto second = makeCalibration(100, 800);
+    const uint16_t first_val = RAW;
+    const uint16_t second_val = (RAW - 100) * Driver::MAX_VAL / 800;
+
+    Driver::SamplerConfig sampler;
+    sampler.period = 0; // as fast as possible
+    CHECK_EQ(ls.startSampling(sampler), ESP_OK);
+
+    // The sampler calibrates each frame, while the calibration and its mode are switched
+    // several times within each frame, which also frees and allocates the LUT.
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+        for (int i = 0; i < 2000; ++i) {
+            CHECK(ls.setCalibration(i % 2 ? second : first));
+            ls.setCalibrationMode(i % 3 ? LineSensor::CALIBRATION_LUT : LineSensor::CALIBRATION_RECIPROCAL);
+        }
+        done = true;
+    });
+
+    uint32_t checked = 0;
+    LineSensor::LineFrame frame;
+    while (!done.load()) {
+        if (ls.readLatestLine(frame) == 0)
+            continue;
+        const uint16_t val = frame.values[0];
+        CHECK(val == first_val || val == second_val);
+        for (int i = 1; i < Driver::CHANNELS; ++i)
+            CHECK_EQ(frame.values[i], val);
+        ++checked;
+    }
+    writer.join();
+    CHECK(checked > 0);
+
+    CHECK_EQ(ls.stopSampling(), ESP_OK);
+    CHECK(ls.setCalibration(second));
+    uint16_t vals[Driver::CHANNELS];
+    CHECK_EQ(ls.calibratedRead(vals), ESP_OK);
+    CHECK_EQ(vals[0], second_val);
+}
+
+static void testStorage() {
+    host_shim::resetNvs();
+
+    LineSensor ls;
+    CHECK_EQ(ls.loadCalibration(), ESP_ERR_NVS_NOT_FOUND);
+
+    const auto data = makeCalibration(50, 900);
+    CHECK(ls.setCalibration(data));
+    CHECK_EQ(ls.saveCalibration(), ESP_OK);
+
+    LineSensor other;
+    CHECK_EQ(other.loadCalibration(), ESP_OK);
+    CHECK_EQ(other.getCalibration().min[3], 50);
+    CHECK_EQ(other.getCalibration().range[7], 900);
+
+    CHECK(host_shim::corruptNvsBlob("mcp3008", "calibration", 6));
+    CHECK_EQ(other.loadCalibration(), ESP_ERR_INVALID_CRC);
+}
+
+static void testCalibratorRejectsSpikes() {
+    // Values spread over <200; 800>, with 1 % of single-frame spikes to each end of the range
+    static constexpr int FRAMES = 1000;
+    std::vector<uint16_t> frames(FRAMES * Driver::CHANNELS);
+    for (int f = 0; f < FRAMES; ++f) {
+        for (int i = 0; i < Driver::CHANNELS; ++i) {
+            uint16_t val = 200 + (f * 37 + i * 11) % 601;
+            if (f % 100 == 0)
+                val = Driver::MAX_VAL;
+            else if (f % 100 == 50)
+                val = 0;
+            frames[f * Driver::CHANNELS + i] = val;
+        }
+    }
+
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+    LineSensor ls;
+    Driver::Config cfg;
+    cfg.transport = &replay;
+    CHECK_EQ(ls.install(cfg), ESP_OK);
+
+    auto calibrator = ls.startCalibration();
+    for (int f = 0; f < FRAMES; ++f)
+        CHECK_EQ(calibrator.record(), ESP_OK);
+
+    // The default 2 % rejection ignores the spikes, within one histogram bin
+    calibrator.save();
+    for (int i = 0; i < Driver::CHANNELS; ++i) {
+        const uint16_t min = ls.getCalibration().min[i];
+        const uint16_t max = min + ls.getCalibration().range[i];
+        CHECK(min >= 200 && min < 200 + 8);
+        CHECK(max <= 800 && max > 800 - 8);
+    }
+
+    // Without the rejection, the spikes set the range
+    calibrator.setRejectFraction(0);
+    calibrator.save();
+    for (int i = 0; i < Driver::CHANNELS; ++i) {
+        CHECK_EQ(ls.getCalibration().min[i], 0);
+        CHECK_EQ(ls.getCalibration().range[i], Driver::MAX_VAL);
+    }
+}
+
+int main() {
+    RUN_TEST(testSwapWhileSampling);
+    RUN_TEST(testStorage);
+    RUN_TEST(testCalibratorRejectsSpikes);
+    return 0;
+}
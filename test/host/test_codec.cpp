@@ -0,0 +1,111 @@
+#include <string.h>
+#include <vector>
+
+#include "mcp3008_codec.h"
+#include "test_util.h"
+
+using namespace mcp3008::codec;
+
+static void testPack10() {
+    CHECK_EQ(packedSize(0), 0);
+    CHECK_EQ(packedSize(1), 2);
+    CHECK_EQ(packedSize(MAX_CHANNELS), 10);
+
+    // Every value at every position of every frame size
+    for (size_t count = 1; count <= MAX_CHANNELS; ++count) {
+        for (uint32_t val = 0; val <= MAX_VAL; ++val) {
+            uint16_t values[MAX_CHANNELS];
+            for (size_t i = 0; i < count; ++i)
+                values[i] = (val + i * 131) % (MAX_VAL + 1);
+
+            uint8_t packed[packedSize(MAX_CHANNELS) + 1];
+            memset(packed, 0xAA, sizeof(packed));
+            pack10(values, count, packed);
+            CHECK_EQ(packed[packedSize(count)], 0xAA);
+            if (count * 10 % 8 != 0)
+                CHECK_EQ(packed[packedSize(count) - 1] >> (count * 10 % 8), 0);
+
+            uint16_t unpacked[MAX_CHANNELS];
+            unpack10(packed, count, unpacked);
+            for (size_t i = 0; i < count; ++i)
+                CHECK_EQ(unpacked[i], values[i]);
+        }
+    }
+}
+
+static void testDeltaRoundTrip() {
+    // Zigzag extremes, both varint length boundaries and unchanged channels
+    const uint16_t frames[][MAX_CHANNELS] = {
+        { 0, MAX_VAL, 63, 64, 500, 0, 1, 1000 },
+        { MAX_VAL, 0, 0, 0, 500, 64, 0, 1000 },
+        { 0, MAX_VAL, 64, 63, 436, 0, 1, 1000 },
+        { MAX_VAL, 0, 0, 127, 501, 0, MAX_VAL, 0 },
+    };
+    const size_t expected_sizes[] = { 12, 11, 11, 14 };
+    const size_t frame_count = sizeof(frames) / sizeof(frames[0]);
+
+    DeltaEncoder encoder(MAX_CHANNELS);
+    std::vector<uint8_t> stream;
+    for (size_t f = 0; f < frame_count; ++f) {
+        uint8_t out[DeltaEncoder::MAX_FRAME_SIZE];
+        const size_t size = encoder.encode(frames[f], out);
+        CHECK_EQ(size, expected_sizes[f]);
+        stream.insert(stream.end(), out, out + size);
+    }
+
+    DeltaDecoder decoder(MAX_CHANNELS);
+    size_t pos = 0;
+    for (size_t f = 0; f < frame_count; ++f) {
+        uint16_t values[MAX_CHANNELS];
+        const size_t used = decoder.decode(stream.data() + pos, stream.size() - pos, values);
+        CHECK_EQ(used, expected_sizes[f]);
+        for (size_t i = 0; i < MAX_CHANNELS; ++i)
+            CHECK_EQ(values[i], frames[f][i]);
+        pos += used;
+    }
+    CHECK_EQ(pos, stream.size());
+
+    // A key frame after reset() decodes on its own
+    encoder.reset();
+    uint8_t key[DeltaEncoder::MAX_FRAME_SIZE];
+    const size_t key_size = encoder.encode(frames[1], key);
+    DeltaDecoder fresh(MAX_CHANNELS);
+    uint16_t values[MAX_CHANNELS];
+    CHECK_EQ(fresh.decode(key, key_size, values), key_size);
+    CHECK_EQ(values[0], MAX_VAL);
+}
+
+static void testDeltaRejects() {
+    const uint16_t frame[MAX_CHANNELS] = { MAX_VAL, 0, 700, 3, MAX_VAL, 200, 0, 900 };
+    DeltaEncoder encoder(MAX_CHANNELS);
+    uint8_t out[DeltaEncoder::MAX_FRAME_SIZE];
+    const size_t size = encoder.encode(frame, out);
+
+    // Every truncation is rejected and leaves the decoder unchanged
+    DeltaDecoder decoder(MAX_CHANNELS);
+    uint16_t values[MAX_CHANNELS];
+    memset(values, 0x55, sizeof(values));
+    for (size_t truncated = 0; truncated < size; ++truncated) {
+        CHECK_EQ(decoder.decode(out, truncated, values), 0);
+        CHECK_EQ(values[0], 0x5555);
+    }
+    CHECK_EQ(decoder.decode(out, size, values), size);
+    for (size_t i = 0; i < MAX_CHANNELS; ++i)
+        CHECK_EQ(values[i], frame[i]);
+
+    // A third varint byte and a value out of the 10-bit range are invalid
+    DeltaDecoder one(1);
+    const uint8_t three_bytes[] = { 0x80, 0x80, 0x01 };
+    CHECK_EQ(one.decode(three_bytes, sizeof(three_bytes), values), 0);
+    const uint8_t negative[] = { 0x01 };
+    CHECK_EQ(one.decode(negative, sizeof(negative), values), 0);
+    const uint8_t too_big[] = { 0x80 | (2048 & 0x7F), 2048 >> 7 };
+    CHECK_EQ(one.decode(too_big, sizeof(too_big), values), 0);
+}
+
+int main() {
+    RUN_TEST(testPack10);
+    RUN_TEST(testDeltaRoundTrip);
+    RUN_TEST(testDeltaRejects);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "mcp3008_line_analysis.h"
+#include "test_util.h"
+
+using namespace mcp3008;
+
+static void testPeakAtThreshold() {
+    // The peak equals the threshold, so no channel is above it
+    const uint16_t vals[Driver::CHANNELS] = { 0, 0, 0, 204, 0, 0, 0, 0 };
+    LineAnalysis res;
+    res.analyze(vals, Driver::CHANNELS, false, 204);
+    CHECK(!res.found());
+    CHECK_EQ(res.position, LineAnalysis::LINE_NOT_FOUND);
+    CHECK_EQ(res.width, 0);
+    CHECK_EQ(res.flags, 0);
+}
+
+static void testContrastAtThreshold() {
+    // The contrast equals the threshold, the background is then taken as 0
+    const uint16_t vals[Driver::CHANNELS] = { 300, 300, 300, 504, 300, 300, 300, 300 };
+    LineAnalysis res;
+    res.analyze(vals, Driver::CHANNELS, false, 204);
+    CHECK(res.found());
+    CHECK(res.position != LineAnalysis::LINE_NOT_FOUND);
+    CHECK_EQ(res.flags & LineAnalysis::FULL_WIDTH, LineAnalysis::FULL_WIDTH);
+}
+
+static void testJustAboveThreshold() {
+    const uint16_t vals[Driver::CHANNELS] = { 0, 0, 0, 205, 0, 0, 0, 0 };
+    LineAnalysis res;
+    res.analyze(vals, Driver::CHANNELS, false, 204);
+    CHECK(res.found());
+    CHECK_EQ(res.segment_count, 1);
+    CHECK_EQ(res.width, 1);
+    CHECK_EQ(res.segments[0].peak, 3);
+    CHECK(res.position < 0);
+}
+
+static void testFork() {
+    const uint16_t vals[Driver::CHANNELS] = { 900, 800, 50, 50, 50, 50, 700, 900 };
+    LineAnalysis res;
+    res.analyze(vals, Driver::CHANNELS);
+    CHECK_EQ(res.segment_count, 2);
+    CHECK_EQ(res.flags & LineAnalysis::MULTIPLE_LINES, LineAnalysis::MULTIPLE_LINES);
+    CHECK(res.segments[0].centroid < 0);
+    CHECK(res.segments[1].centroid > 0);
+}
+
+int main() {
+    RUN_TEST(testPeakAtThreshold);
+    RUN_TEST(testContrastAtThreshold);
+    RUN_TEST(testJustAboveThreshold);
+    RUN_TEST(testFork);
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <algorithm>
+
+#include "mcp3008_line_tracker.h"
+#include "mcp3008_linesensor.h"
+#include "mcp3008_transport.h"
+#include "test_util.h"
+
+using namespace mcp3008;
+
+static constexpr uint16_t BACKGROUND = 100;
+static constexpr uint16_t LINE = 900;
+static constexpr int NO_LINE = -1;
+
+// Replays one frame with a dark line under channel \p line_at until the next step()
+class Track {
+public:
+    explicit Track(uint8_t full_scan_interval = 16)
+        : tracker(false, Driver::MAX_VAL / 5, 1, full_scan_interval) {
+        Driver::Config cfg;
+        cfg.transport = &replay;
+        CHECK_EQ(ls.install(cfg), ESP_OK);
+    }
+
+    LineTracker::Result step(int line_at) {
+        uint16_t frame[Driver::CHANNELS];
+        for (int i = 0; i < Driver::CHANNELS; ++i)
+            frame[i] = i == line_at ? LINE : BACKGROUND;
+        replay.setFrames(frame, 1);
+        return ls.readLineTracked(tracker);
+    }
+
+    uint64_t conversions() const { return replay.getConversions(); }
+
+    ReplayTransport replay;
+    LineSensor ls;
+    LineTracker tracker;
+};
+
+// Position of a line under just one channel, see LineSensor::readLineFixed()
+static int16_t positionOf(int chan) {
+    const int32_t middle = (Driver::CHANNELS - 1) * Driver::MAX_VAL / 2;
+    const int32_t pos = (chan * Driver::MAX_VAL - middle) * LineTracker::LINE_MAX / middle;
+    return std::min<int32_t>(LineTracker::LINE_MAX, std::max<int32_t>(-LineTracker::LINE_MAX, pos));
+}
+
+static void testNeverSeen() {
+    Track t;
+    const auto res = t.step(NO_LINE);
+    CHECK_EQ(res.state, LineTracker::LINE_NEVER_SEEN);
+    CHECK_EQ(res.position, LineTracker::LINE_NOT_FOUND);
+    CHECK(res.full_scan);
+    CHECK(!t.tracker.isTracking());
+}
+
+static void testWindowedReads() {
+    Track t;
+    auto res = t.step(3);
+    CHECK_EQ(res.state, LineTracker::LINE_FOUND);
+    CHECK(res.full_scan);
+    CHECK_EQ(res.position, positionOf(3));
+    CHECK_EQ(t.conversions(), Driver::CHANNELS);
+    CHECK(t.tracker.isTracking());
+
+    // Same line, only the window of channels 2 to 4 is converted
+    size_t lo, hi;
+    t.tracker.getWindow(Driver::CHANNELS, lo, hi);
+    CHECK_EQ(lo, 2);
+    CHECK_EQ(hi, 4);
+    res = t.step(3);
+    CHECK_EQ(res.state, LineTracker::LINE_FOUND);
+    CHECK(!res.full_scan);
+    CHECK_EQ(res.position, positionOf(3));
+    CHECK_EQ(t.conversions(), 3);
+}
+
+static void testAcrossTheArray() {
+    Track t;
+    CHECK(t.step(0).full_scan);
+
+    // Each move reaches the edge of the window, the tracker then rescans all channels,
+    // except at the edge of the array. Staying on the line adds a windowed frame.
+    for (int chan = 1; chan < Driver::CHANNELS; ++chan) {
+        size_t lo, hi;
+        t.tracker.getWindow(Driver::CHANNELS, lo, hi);
+        const bool edge = chan == Driver::CHANNELS - 1;
+
+        auto res = t.step(chan);
+        CHECK_EQ(res.state, LineTracker::LINE_FOUND);
+        CHECK_EQ(res.full_scan, !edge);
+        CHECK_EQ(res.position, positionOf(chan));
+        CHECK_EQ(t.conversions(), hi - lo + 1 + (edge ? 0 : Driver::CHANNELS));
+
+        res = t.step(chan);
+        CHECK(!res.full_scan);
+        CHECK_EQ(res.position, positionOf(chan));
+    }
+    CHECK_EQ(t.tracker.getLastPosition(), LineTracker::LINE_MAX);
+}
+
+static void testLostRight() {
+    Track t;
+    for (int chan = 4; chan < Driver::CHANNELS; ++chan)
+        CHECK_EQ(t.step(chan).state, LineTracker::LINE_FOUND);
+
+    // Off the right edge, the faint window falls back to a full scan
+    for (int i = 0; i < 3; ++i) {
+        const auto res = t.step(NO_LINE);
+        CHECK_EQ(res.state, LineTracker::LINE_LOST_RIGHT);
+        CHECK_EQ(res.position, LineTracker::LINE_MAX);
+        CHECK(res.full_scan);
+    }
+
+    // Found again anywhere
+    const auto res = t.step(2);
+    CHECK_EQ(res.state, LineTracker::LINE_FOUND);
+    CHECK_EQ(res.position, positionOf(2));
+}
+
+static void testLostLeft() {
+    Track t;
+    for (int chan = 3; chan >= 0; --chan)
+        CHECK_EQ(t.step(chan).state, LineTracker::LINE_FOUND);
+
+    auto res = t.step(NO_LINE);
+    CHECK_EQ(res.state, LineTracker::LINE_LOST_LEFT);
+    CHECK_EQ(res.position, -LineTracker::LINE_MAX);
+
+    // Moved across the array since, the side follows the last position
+    CHECK_EQ(t.step(6).state, LineTracker::LINE_FOUND);
+    res = t.step(NO_LINE);
+    CHECK_EQ(res.state, LineTracker::LINE_LOST_RIGHT);
+
+    t.tracker.reset();
+    CHECK_EQ(t.step(NO_LINE).state, LineTracker::LINE_NEVER_SEEN);
+}
+
+static void testFullScanInterval() {
+    Track t(4);
+    CHECK(t.step(5).full_scan);
+    for (int i = 0; i < 4; ++i)
+        CHECK(!t.step(5).full_scan);
+    CHECK(t.step(5).full_scan);
+    CHECK(!t.step(5).full_scan);
+}
+
+int main() {
+    RUN_TEST(testNeverSeen);
+    RUN_TEST(testWindowedReads);
+    RUN_TEST(testAcrossTheArray);
+    RUN_TEST(testLostRight);
+    RUN_TEST(testLostLeft);
+    RUN_TEST(testFullScanInterval);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+#include "mcp3008_linesensor.h"
+#include "mcp3008_linesensor_fixed.h"
+#include "mcp3008_transport.h"
+#include "test_util.h"
+
+// The line position path must not touch the heap, see LineSensor::readLine().
+// Every allocation through operator new is counted while s_counting is set.
+
+using namespace mcp3008;
+
+static std::atomic<bool> s_counting(false);
+static std::atomic<int> s_allocations(0);
+
+void* operator new(size_t size) {
+    if (s_counting.load())
+        ++s_allocations;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+static constexpr int FRAMES = 32;
+static constexpr int ITERATIONS = 1000;
+
+static std::vector<uint16_t> makeFrames() {
+    std::vector<uint16_t> frames(FRAMES * Driver::CHANNELS, 80);
+    for (int f = 0; f < FRAMES; ++f)
+        frames[f * Driver::CHANNELS + f % Driver::CHANNELS] = 950;
+    return frames;
+}
+
+template <typename Fn>
+static int countAllocations(Fn fn) {
+    s_allocations = 0;
+    s_counting = true;
+    for (int i = 0; i < ITERATIONS; ++i)
+        fn();
+    s_counting = false;
+    return s_allocations.load();
+}
+
+static void testReadLine() {
+    const auto frames = makeFrames();
+    for (int polling = 0; polling < 2; ++polling) {
+        ReplayTransport replay;
+        replay.setFrames(frames.data(), FRAMES);
+
+        LineSensor ls;
+        Driver::Config cfg;
+        cfg.transport = &replay;
+        cfg.polling = polling;
+        CHECK_EQ(ls.install(cfg), ESP_OK);
+
+        // The std::vector overload allocates, which shows the counting works
+        CHECK(countAllocations([&]() { std::vector<uint16_t> results; ls.calibratedRead(results); }) > 0);
+
+        uint16_t vals[Driver::CHANNELS];
+        CHECK_EQ(countAllocations([&]() { ls.readLine(); }), 0);
+        CHECK_EQ(countAllocations([&]() { ls.readLineFixed(true); }), 0);
+        CHECK_EQ(countAllocations([&]() { ls.calibratedRead(vals); }), 0);
+        CHECK_EQ(countAllocations([&]() { LineSensor::computeLineFixed(vals, Driver::CHANNELS); }), 0);
+
+        for (auto estimator : { LineSensor::LINE_PARABOLIC, LineSensor::LINE_PEAK_CENTROID }) {
+            ls.setLineEstimator(estimator);
+            CHECK_EQ(countAllocations([&]() { ls.readLineFixed(); }), 0);
+        }
+
+        LineAnalysis analysis;
+        CHECK_EQ(countAllocations([&]() { ls.readLineAnalysis(analysis); }), 0);
+    }
+}
+
+static void testFiltered() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    LineSensor ls;
+    Driver::Config cfg;
+    cfg.transport = &replay;
+    cfg.queue_size = 4 * Driver::CHANNELS;
+    CHECK_EQ(ls.install(cfg), ESP_OK);
+
+    for (auto type : { LineSensor::FILTER_NONE, LineSensor::FILTER_EMA, LineSensor::FILTER_MEDIAN3 }) {
+        ls.setFilter(LineSensor::FilterConfig(4, type));
+        CHECK_EQ(countAllocations([&]() { ls.readLineFixed(); }), 0);
+    }
+}
+
+static void testFixedMask() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    LineSensorT<0x7E> ls;
+    Driver::Config cfg;
+    cfg.transport = &replay;
+    CHECK_EQ(ls.install(cfg), ESP_OK);
+    CHECK_EQ(countAllocations([&]() { ls.readLine(); }), 0);
+}
+
+int main() {
+    RUN_TEST(testReadLine);
+    RUN_TEST(testFiltered);
+    RUN_TEST(testFixedMask);
+    return 0;
+}
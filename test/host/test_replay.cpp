@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <freertos/task.h>
+#include <vector>
+
+#include "mcp3008_linesensor.h"
+#include "mcp3008_linesensor_fixed.h"
+#include "mcp3008_transport.h"
+#include "test_util.h"
+
+using namespace mcp3008;
+
+static constexpr int FRAMES = 16;
+
+static std::vector<uint16_t> makeFrames() {
+    std::vector<uint16_t> frames(FRAMES * Driver::CHANNELS);
+    for (size_t i = 0; i < frames.size(); ++i)
+        frames[i] = (i * 37 + 5) % (Driver::MAX_VAL + 1);
+    return frames;
+}
+
+static Driver::Config replayConfig(ReplayTransport& replay) {
+    Driver::Config cfg;
+    cfg.transport = &replay;
+    return cfg;
+}
+
+static void testRead() {
+    const auto frames = makeFrames();
+    for (int compact = 0; compact < 2; ++compact) {
+        for (int polling = 0; polling < 2; ++polling) {
+            ReplayTransport replay;
+            replay.setFrames(frames.data(), FRAMES);
+
+            Driver drv;
+            auto cfg = replayConfig(replay);
+            cfg.compact_framing = compact;
+            cfg.polling = polling;
+            CHECK_EQ(drv.install(cfg), ESP_OK);
+
+            for (int f = 0; f < FRAMES; ++f) {
+                uint16_t vals[Driver::CHANNELS];
+                CHECK_EQ(drv.read(vals), ESP_OK);
+                for (int i = 0; i < Driver::CHANNELS; ++i)
+                    CHECK_EQ(vals[i], frames[f * Driver::CHANNELS + i]);
+            }
+
+            uint16_t vals[2];
+            CHECK_EQ(drv.read((1 << 2) | (1 << 6), vals), ESP_OK);
+            CHECK_EQ(vals[0], frames[2]);
+            CHECK_EQ(vals[1], frames[6]);
+            CHECK_EQ(drv.uninstall(), ESP_OK);
+        }
+    }
+}
+
+static void testMask() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    auto cfg = replayConfig(replay);
+    cfg.channels_mask = 0xA5;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+    CHECK_EQ(drv.getChannelsCount(), 4);
+
+    uint16_t vals[4];
+    CHECK_EQ(drv.read(vals), ESP_OK);
+    CHECK_EQ(vals[0], frames[0]);
+    CHECK_EQ(vals[1], frames[2]);
+    CHECK_EQ(vals[2], frames[5]);
+    CHECK_EQ(vals[3], frames[7]);
+
+    esp_err_t res = ESP_FAIL;
+    // Channel 3 was not read from the first frame yet
+    CHECK_EQ(drv.readChannel(3, false, &res), frames[3]);
+    CHECK_EQ(res, ESP_OK);
+}
+
+static void testReadFrames() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    auto cfg = replayConfig(replay);
+    cfg.queue_size = 20;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+
+    std::vector<uint16_t> dest(FRAMES * Driver::CHANNELS);
+    CHECK_EQ(drv.readFrames(dest.data(), FRAMES), ESP_OK);
+    CHECK(dest == frames);
+}
+
+static void testStartRead() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    CHECK_EQ(drv.install(replayConfig(replay)), ESP_OK);
+
+    uint16_t vals[Driver::CHANNELS];
+    CHECK_EQ(drv.startRead(), ESP_OK);
+    CHECK(drv.isReadPending());
+    CHECK_EQ(drv.startRead(), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(drv.finishRead(vals), ESP_OK);
+    CHECK(!drv.isReadPending());
+    for (int i = 0; i < Driver::CHANNELS; ++i)
+        CHECK_EQ(vals[i], frames[i]);
+    CHECK_EQ(drv.finishRead(vals), ESP_ERR_INVALID_STATE);
+
+    // Nothing else may reuse the in-flight transactions
+    CHECK_EQ(drv.startReadMask(0x41), ESP_OK);
+    esp_err_t res = ESP_OK;
+    CHECK_EQ(drv.read(vals), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(drv.read(0x01, vals), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(drv.readChannel(0, false, &res), 0xFFFF);
+    CHECK_EQ(res, ESP_ERR_INVALID_STATE);
+    CHECK_EQ(drv.readFrames(vals, 1), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(drv.startSampling(Driver::SamplerConfig()), ESP_FAIL);
+    CHECK_EQ(drv.finishRead(vals), ESP_OK);
+    CHECK_EQ(vals[0], frames[Driver::CHANNELS]);
+    CHECK_EQ(vals[1], frames[Driver::CHANNELS + 6]);
+}
+
+static bool isSampledValue(const std::vector<uint16_t>& frames, int chan, uint16_t val) {
+    for (int f = 0; f < FRAMES; ++f) {
+        if (frames[f * Driver::CHANNELS + chan] == val)
+            return true;
+    }
+    return false;
+}
+
+static void testStartReadWhileSampling() {
+    const auto frames = makeFrames();
+    for (int polling = 0; polling < 2; ++polling) {
+        ReplayTransport replay;
+        replay.setFrames(frames.data(), FRAMES);
+
+        Driver drv;
+        auto cfg = replayConfig(replay);
+        cfg.polling = polling;
+        CHECK_EQ(drv.install(cfg), ESP_OK);
+        CHECK_EQ(drv.startSampling(Driver::SamplerConfig()), ESP_OK);
+
+        // Sized for the requested channel only, a whole frame would overflow it
+        std::vector<uint16_t> val(1);
+        for (int i = 0; i < 20000; ++i) {
+            CHECK_EQ(drv.startReadMask(0x04), ESP_OK);
+            CHECK_EQ(drv.finishRead(val.data()), ESP_OK);
+            CHECK(isSampledValue(frames, 2, val[0]));
+        }
+
+        // Stopped in between, the frame is then read from the chip
+        CHECK_EQ(drv.startReadMask(0x04), ESP_OK);
+        CHECK_EQ(drv.stopSampling(), ESP_OK);
+        CHECK_EQ(drv.finishRead(val.data()), ESP_OK);
+        CHECK(isSampledValue(frames, 2, val[0]));
+        CHECK_EQ(drv.uninstall(), ESP_OK);
+    }
+}
+
+static void testSampling() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    CHECK_EQ(drv.install(replayConfig(replay)), ESP_OK);
+
+    Driver::SamplerConfig sampler;
+    sampler.period_us = 500;
+    CHECK_EQ(drv.startSampling(sampler), ESP_OK);
+    CHECK(drv.isSampling());
+
+    Driver::Frame frame;
+    const uint32_t first = drv.readLatest(frame);
+    CHECK(first != 0);
+    vTaskDelay(20);
+    CHECK(drv.readLatest(frame) != first);
+
+    bool matches = false;
+    for (int f = 0; f < FRAMES && !matches; ++f)
+        matches = std::equal(frame.values, frame.values + Driver::CHANNELS, frames.begin() + f * Driver::CHANNELS);
+    CHECK(matches);
+
+    CHECK_EQ(drv.stopSampling(), ESP_OK);
+    CHECK(!drv.isSampling());
+    CHECK(drv.getSamplingStats().frames > 1);
+}
+
+static void testStopTimerSampling() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    CHECK_EQ(drv.install(replayConfig(replay)), ESP_OK);
+
+    // A timer callback may still run after stopSampling(), see the esp_timer shim,
+    // it must not find a stale task to notify.
+    Driver::SamplerConfig sampler;
+    sampler.period_us = 5;
+    for (int i = 0; i < 500; ++i) {
+        CHECK_EQ(drv.startSampling(sampler), ESP_OK);
+        CHECK_EQ(drv.stopSampling(), ESP_OK);
+    }
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+}
+
+static void testStopSamplingWithNotification() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    CHECK_EQ(drv.install(replayConfig(replay)), ESP_OK);
+
+    for (int i = 0; i < 50; ++i) {
+        CHECK_EQ(drv.startSampling(Driver::SamplerConfig()), ESP_OK);
+
+        // A notification of the caller's own, it must neither end the wait nor be consumed
+        xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        CHECK_EQ(drv.stopSampling(), ESP_OK);
+
+        const uint32_t conversions = replay.getConversions();
+        vTaskDelay(1);
+        CHECK_EQ(replay.getConversions(), conversions);
+        CHECK_EQ(ulTaskNotifyTake(pdTRUE, 0), 1);
+    }
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+}
+
+static void testLazyInstall() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    Driver drv;
+    auto cfg = replayConfig(replay);
+    cfg.lazy_install = true;
+    cfg.channels_mask = 0x0F;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+    CHECK_EQ(drv.getChannelsCount(), 4);
+    CHECK_EQ(replay.getConversions(), 0);
+
+    uint16_t vals[4];
+    CHECK_EQ(drv.read(vals), ESP_OK);
+    CHECK_EQ(replay.getConversions(), 4);
+    CHECK_EQ(vals[3], frames[3]);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+    CHECK_EQ(drv.read(vals), ESP_FAIL);
+}
+
+static void testLineSensor() {
+    // A dark line moving from the first channel to the last one
+    std::vector<uint16_t> frames(Driver::CHANNELS * Driver::CHANNELS, 100);
+    for (int f = 0; f < Driver::CHANNELS; ++f)
+        frames[f * Driver::CHANNELS + f] = 900;
+
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), Driver::CHANNELS);
+
+    LineSensor ls;
+    CHECK_EQ(ls.install(replayConfig(replay)), ESP_OK);
+
+    int16_t last = INT16_MIN;
+    for (int f = 0; f < Driver::CHANNELS; ++f) {
+        const int16_t pos = ls.readLineFixed();
+        CHECK(pos != LineSensor::LINE_NOT_FOUND);
+        CHECK(pos > last);
+        last = pos;
+    }
+    CHECK_EQ(last, LineSensor::LINE_MAX);
+}
+
+static void testLineSensorTMask() {
+    const auto frames = makeFrames();
+    ReplayTransport replay;
+    replay.setFrames(frames.data(), FRAMES);
+
+    // Installed through the base class, with more channels than the fixed mask
+    LineSensorT<0x0F> ls;
+    CHECK_EQ(static_cast<LineSensor&>(ls).install(replayConfig(replay)), ESP_OK);
+    uint16_t vals[LineSensorT<0x0F>::COUNT];
+    CHECK_EQ(ls.calibratedRead(vals), ESP_ERR_INVALID_STATE);
+    CHECK_EQ(ls.readLineFixed(), LineSensor::LINE_NOT_FOUND);
+    CHECK_EQ(ls.uninstall(), ESP_OK);
+
+    CHECK_EQ(ls.install(replayConfig(replay)), ESP_OK);
+    CHECK_EQ(ls.getChannelsMask(), 0x0F);
+    CHECK_EQ(ls.calibratedRead(vals), ESP_OK);
+}
+
+int main() {
+    RUN_TEST(testRead);
+    RUN_TEST(testMask);
+    RUN_TEST(testReadFrames);
+    RUN_TEST(testStartRead);
+    RUN_TEST(testStartReadWhileSampling);
+    RUN_TEST(testSampling);
+    RUN_TEST(testStopTimerSampling);
+    RUN_TEST(testStopSamplingWithNotification);
+    RUN_TEST(testLazyInstall);
+    RUN_TEST(testLineSensor);
+    RUN_TEST(testLineSensorTMask);
+    return 0;
+}
@@ -0,0 +1,267 @@
+#include <host_shim.h>
+#include <vector>
+
+#include "mcp3008_linesensor_array.h"
+#include "test_util.h"
+
+// The Driver on the shim's SPI master, with a fake MCP3008 answering each host.
+
+using namespace mcp3008;
+
+static uint16_t chipValue(spi_host_device_t host, int channel) {
+    return 100 * channel + host;
+}
+
+static esp_err_t respondChip(spi_host_device_t host, int, spi_transaction_t* trans, void*) {
+    const bool compact = trans->length == Driver::COMPACT_FRAME_BITS;
+    const int channel = compact ? (trans->tx_data[0] >> 3) & 0x07 : (trans->tx_data[1] >> 4) & 0x07;
+    const uint16_t val = chipValue(host, channel);
+    if (compact) {
+        trans->rx_data[0] = (val >> 9) & 0x01;
+        trans->rx_data[1] = (val >> 1) & 0xFF;
+        trans->rx_data[2] = (val & 0x01) << 7;
+    } else {
+        trans->rx_data[0] = 0;
+        trans->rx_data[1] = (val >> 8) & 0x03;
+        trans->rx_data[2] = val & 0xFF;
+    }
+    return ESP_OK;
+}
+
+static Driver::Config chipConfig(spi_host_device_t host, gpio_num_t pin_cs) {
+    Driver::Config cfg(pin_cs);
+    cfg.spi_dev = host;
+    return cfg;
+}
+
+static void testOwnBus() {
+    Driver drv;
+    CHECK_EQ(drv.install(chipConfig(HSPI_HOST, GPIO_NUM_25)), ESP_OK);
+    CHECK(host_shim::isSpiBusInitialized(HSPI_HOST));
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 1);
+
+    uint16_t vals[Driver::CHANNELS];
+    CHECK_EQ(drv.read(vals), ESP_OK);
+    for (int i = 0; i < Driver::CHANNELS; ++i)
+        CHECK_EQ(vals[i], chipValue(HSPI_HOST, i));
+
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+    CHECK(!host_shim::isSpiBusInitialized(HSPI_HOST));
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 0);
+}
+
+static void testArrayOnBothHosts() {
+    LineSensorArray array;
+    const std::vector<Driver::Config> chips = {
+        chipConfig(HSPI_HOST, GPIO_NUM_25),
+        chipConfig(VSPI_HOST, GPIO_NUM_5),
+        chipConfig(HSPI_HOST, GPIO_NUM_27),
+    };
+    CHECK_EQ(array.install(chips), ESP_OK);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 2);
+    CHECK_EQ(host_shim::getSpiDeviceCount(VSPI_HOST), 1);
+
+    std::vector<uint16_t> vals(array.getChannelsCount());
+    CHECK_EQ(array.read(vals.data()), ESP_OK);
+    CHECK_EQ(vals[Driver::CHANNELS + 3], chipValue(VSPI_HOST, 3));
+    CHECK_EQ(vals[2 * Driver::CHANNELS + 7], chipValue(HSPI_HOST, 7));
+
+    CHECK_EQ(array.uninstall(), ESP_OK);
+    CHECK(!host_shim::isSpiBusInitialized(HSPI_HOST));
+    CHECK(!host_shim::isSpiBusInitialized(VSPI_HOST));
+}
+
+static void testArraySameDma() {
+    auto hspi = chipConfig(HSPI_HOST, GPIO_NUM_25);
+    auto vspi = chipConfig(VSPI_HOST, GPIO_NUM_5);
+    hspi.dma_chan = 1;
+    vspi.dma_chan = 1;
+
+    LineSensorArray array;
+    CHECK_EQ(array.install({ hspi, vspi }), ESP_ERR_INVALID_ARG);
+    CHECK(!host_shim::isSpiBusInitialized(HSPI_HOST));
+
+    vspi.dma_chan = 0;
+    CHECK_EQ(array.install({ hspi, vspi }), ESP_OK);
+    CHECK_EQ(array.uninstall(), ESP_OK);
+}
+
+static void testSharedBus() {
+    // Initialized by e.g. an SD card driver before the Driver
+    spi_bus_config_t buscfg = {};
+    CHECK_EQ(spi_bus_initialize(HSPI_HOST, &buscfg, 1), ESP_OK);
+
+    Driver drv;
+    CHECK_EQ(drv.install(chipConfig(HSPI_HOST, GPIO_NUM_25)), ESP_OK);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 1);
+    CHECK_EQ(drv.readChannel(4), chipValue(HSPI_HOST, 4));
+
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 0);
+    CHECK(host_shim::isSpiBusInitialized(HSPI_HOST));
+    CHECK_EQ(spi_bus_free(HSPI_HOST), ESP_OK);
+}
+
+static void testBusConflicts() {
+    Driver drv;
+
+    host_shim::claimSpiHost(VSPI_HOST);
+    CHECK_EQ(drv.install(chipConfig(VSPI_HOST, GPIO_NUM_5)), ESP_ERR_INVALID_STATE);
+    host_shim::claimSpiHost(VSPI_HOST, false);
+
+    host_shim::claimDmaChannel(2);
+    CHECK_EQ(drv.install(chipConfig(VSPI_HOST, GPIO_NUM_5)), ESP_ERR_INVALID_STATE);
+    CHECK(!host_shim::isSpiBusInitialized(VSPI_HOST));
+
+    auto no_dma = chipConfig(VSPI_HOST, GPIO_NUM_5);
+    no_dma.dma_chan = 0;
+    CHECK_EQ(drv.install(no_dma), ESP_OK);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+    host_shim::claimDmaChannel(2, false);
+}
+
+// A chip whose conversions go wrong above max_ok_freq, or fail after fail_after transactions.
+struct TuningChip {
+    int max_ok_freq;
+    uint16_t value;
+    int fail_after;
+    int transactions;
+};
+
+static esp_err_t respondTuningChip(spi_host_device_t, int clock_speed_hz, spi_transaction_t* trans, void* arg) {
+    auto* chip = (TuningChip*)arg;
+    if (chip->fail_after >= 0 && chip->transactions++ >= chip->fail_after)
+        return ESP_ERR_TIMEOUT;
+
+    const uint16_t val = clock_speed_hz <= chip->max_ok_freq ? chip->value : chip->value / 2;
+    trans->rx_data[0] = 0;
+    trans->rx_data[1] = (val >> 8) & 0x03;
+    trans->rx_data[2] = val & 0xFF;
+    return ESP_OK;
+}
+
+static Driver::Config tuningConfig() {
+    auto cfg = chipConfig(HSPI_HOST, GPIO_NUM_25);
+    cfg.freq = 1000000;
+    cfg.max_freq = 4000000;
+    return cfg;
+}
+
+static void testTuneFrequency() {
+    TuningChip chip = { 2000000, 600, -1, 0 };
+    host_shim::setSpiResponder(respondTuningChip, &chip);
+
+    Driver drv;
+    CHECK_EQ(drv.install(tuningConfig()), ESP_OK);
+    CHECK(drv.getFrequency() <= chip.max_ok_freq);
+    CHECK(drv.getFrequency() > chip.max_ok_freq * 4 / 5);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 1);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+
+    host_shim::setSpiResponder(respondChip);
+}
+
+static void testTuneReference() {
+    TuningChip chip = { 2000000, 600, -1, 0 };
+    host_shim::setSpiResponder(respondTuningChip, &chip);
+
+    auto cfg = tuningConfig();
+    cfg.reference_channel = 3;
+    cfg.reference_value = 600;
+    Driver drv;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+    CHECK(drv.getFrequency() > cfg.freq);
+    CHECK(drv.getFrequency() <= chip.max_ok_freq);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+
+    // The reference is already off at the base frequency, so nothing is tuned,
+    // even though the broken conversions above it happen to match the reference
+    chip.max_ok_freq = cfg.freq;
+    cfg.reference_value = chip.value / 2;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+    CHECK_EQ(drv.getFrequency(), cfg.freq);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+
+    host_shim::setSpiResponder(respondChip);
+}
+
+static void testTuneFailure() {
+    // Fails during the first measurement, with the device still added
+    TuningChip chip = { 2000000, 600, 5, 0 };
+    host_shim::setSpiResponder(respondTuningChip, &chip);
+
+    auto cfg = tuningConfig();
+    cfg.lazy_install = true;
+    Driver drv;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+
+    uint16_t vals[Driver::CHANNELS];
+    CHECK_EQ(drv.read(vals), ESP_ERR_TIMEOUT);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 0);
+    CHECK(!host_shim::isSpiBusInitialized(HSPI_HOST));
+
+    // The retry attaches exactly one device
+    chip.fail_after = -1;
+    CHECK_EQ(drv.read(vals), ESP_OK);
+    CHECK_EQ(vals[0], 600);
+    CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 1);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+    CHECK(!host_shim::isSpiBusInitialized(HSPI_HOST));
+
+    host_shim::setSpiResponder(respondChip);
+}
+
+static constexpr gpio_num_t EMITTER_PIN = GPIO_NUM_33;
+
+// The sensors see 200 from the ambient light and 600 more with the emitters on
+static esp_err_t respondEmitterChip(spi_host_device_t, int, spi_transaction_t* trans, void*) {
+    const uint16_t val = gpio_get_level(EMITTER_PIN) ? 800 : 200;
+    trans->rx_data[0] = 0;
+    trans->rx_data[1] = (val >> 8) & 0x03;
+    trans->rx_data[2] = val & 0xFF;
+    return ESP_OK;
+}
+
+static void testAmbientCompensation() {
+    host_shim::setSpiResponder(respondEmitterChip);
+
+    auto cfg = chipConfig(HSPI_HOST, GPIO_NUM_25);
+    cfg.pin_emitter = EMITTER_PIN;
+    Driver drv;
+    CHECK_EQ(drv.install(cfg), ESP_OK);
+    CHECK_EQ(gpio_get_level(EMITTER_PIN), 1);
+
+    uint16_t vals[Driver::CHANNELS];
+    uint16_t ambient[Driver::CHANNELS];
+    CHECK_EQ(drv.readAmbientCompensated(vals, false, ambient), ESP_OK);
+    for (int i = 0; i < Driver::CHANNELS; ++i) {
+        CHECK_EQ(vals[i], 600);
+        CHECK_EQ(ambient[i], 200);
+    }
+    CHECK_EQ(gpio_get_level(EMITTER_PIN), 1);
+    CHECK_EQ(drv.uninstall(), ESP_OK);
+
+    // No channel to switch the emitters on, with or without the settling conversions
+    for (uint8_t settle : { 0, 2 }) {
+        cfg.channels_mask = 0;
+        cfg.emitter_settle = settle;
+        CHECK_EQ(drv.install(cfg), ESP_ERR_INVALID_ARG);
+        CHECK_EQ(host_shim::getSpiDeviceCount(HSPI_HOST), 0);
+    }
+
+    host_shim::setSpiResponder(respondChip);
+}
+
+int main() {
+    host_shim::setSpiResponder(respondChip);
+    RUN_TEST(testOwnBus);
+    RUN_TEST(testArrayOnBothHosts);
+    RUN_TEST(testArraySameDma);
+    RUN_TEST(testSharedBus);
+    RUN_TEST(testBusConflicts);
+    RUN_TEST(testTuneFrequency);
+    RUN_TEST(testTuneReference);
+    RUN_TEST(testTuneFailure);
+    RUN_TEST(testAmbientCompensation);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal assertions for the host tests, a failed CHECK ends the test with exit code 1.
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                             \
+        }                                                                        \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                   \
+    do {                                                                                 \
+        const long long check_a = (long long)(a);                                        \
+        const long long check_b = (long long)(b);                                        \
+        if (check_a != check_b) {                                                        \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, \
+                __LINE__, #a, #b, check_a, check_b);                                     \
+            exit(1);                                                                     \
+        }                                                                                \
+    } while (0)
+
+#define RUN_TEST(fn)                          \
+    do {                                      \
+        fprintf(stderr, "[ RUN  ] %s\n", #fn); \
+        fn();                                 \
+        fprintf(stderr, "[  OK  ] %s\n", #fn); \
+    } while (0)